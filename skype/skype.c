@@ -20,8 +20,16 @@
  */
 
 #define _XOPEN_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
 #include <bitlbee.h>
 #include <ssl_client.h>
 
@@ -29,6 +37,31 @@
 #define SKYPE_DEFAULT_PORT "2727"
 #define IRC_LINE_SIZE 16384
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+/* Only this much of a relayed file is held in memory at once. */
+#define SKYPE_RELAY_CHUNK 65536
+/* Seconds for which an info command result is answered locally. */
+#define SKYPE_INFO_TTL 60
+/* Seconds after which an unanswered info command may be sent again. */
+#define SKYPE_INFO_TIMEOUT 30
+/* Milliseconds to wait for skyped to accept a link feature. */
+#define SKYPE_NEGOTIATE_TIMEOUT 5000
+/* Protocol v2 frames: payload length and request id, both 32 bit in
+ * network byte order, then the payload without any terminator. */
+#define SKYPE_FRAME_HEADER 8
+/* Anything longer is a corrupted stream, not a real frame. */
+#define SKYPE_FRAME_MAX (16 * 1024 * 1024)
+/* Seconds after which we stop waiting for the reply of a bulk command;
+ * skyped sends none at all if Skype failed it. */
+#define SKYPE_REQUEST_TIMEOUT 10
+/* Bulk replies slower than this many milliseconds make the adaptive rate
+ * limit back off. */
+#define SKYPE_BULK_LATENCY 500
+/* Upper bound in seconds for the delay between reconnect attempts. */
+#define SKYPE_RECONNECT_MAX_DELAY 300
+/* Interactive commands held back while the link is down, at most. */
+#define SKYPE_HELD_MAX 100
+/* The info property we ask for last, see skype_get_info(). */
+#define SKYPE_INFO_LAST "BIRTHDAY"
 
 /*
  * Enumerations
@@ -39,14 +72,34 @@ enum {
 	SKYPE_CALL_MISSED,
 	SKYPE_CALL_CANCELLED,
 	SKYPE_CALL_FINISHED,
-	SKYPE_CALL_REFUSED
+	SKYPE_CALL_REFUSED,
+	SKYPE_CALL_FAILED,
+	SKYPE_CALL_BUSY,
+	/* Any other (non-terminal) status, like ROUTING or INPROGRESS. */
+	SKYPE_CALL_ACTIVE
 };
 
 enum {
 	SKYPE_FILETRANSFER_NEW = 1,
 	SKYPE_FILETRANSFER_TRANSFERRING,
 	SKYPE_FILETRANSFER_COMPLETED,
-	SKYPE_FILETRANSFER_FAILED
+	SKYPE_FILETRANSFER_FAILED,
+	SKYPE_FILETRANSFER_CANCELLED,
+	/* Any other (non-terminal) status, like CONNECTING or PAUSED. */
+	SKYPE_FILETRANSFER_OTHER
+};
+
+/* Link features, requested one after the other in this order. */
+enum {
+	SKYPE_NEGOTIATE_COMPRESS = 1,
+	SKYPE_NEGOTIATE_FRAMING,
+	SKYPE_NEGOTIATE_DONE
+};
+
+/* Priority lanes of outgoing commands, see skype_write(). */
+enum {
+	SKYPE_LANE_INTERACTIVE,
+	SKYPE_LANE_BULK
 };
 
 /*
@@ -62,8 +115,89 @@ struct skype_data {
 	/* File descriptor returned by bitlbee. we store it so we know when
 	 * we're connected and when we aren't. */
 	int bfd;
-	/* ssl_getfd() uses this to get the file desciptor. */
+	/* ssl_getfd() uses this to get the file desciptor. NULL if we talk
+	 * to skyped over a plain unix socket. */
 	void *ssl;
+	/* Timer of the next reconnect attempt, 0 if not waiting. */
+	gint reconnect_id;
+	/* Number of failed reconnect attempts in a row. */
+	int reconnect_attempts;
+	/* Set once we reconnected after losing the link, so that we keep what
+	 * we already know instead of fetching everything again. */
+	int resync;
+	/* The status we set last, restored after reconnecting. */
+	const char *status;
+	/* Interactive commands written while the link was down, char*, sent
+	 * once we are back. */
+	GQueue *interactive;
+	/* Received data which is not yet a whole line or frame. */
+	GString *rbuf;
+	/* If the link is deflate compressed, see skype_parse_compress(). */
+	int compress;
+	/* Set when the rest of rbuf has to be inflated. */
+	int compress_start;
+	z_stream zin;
+	z_stream zout;
+	/* If skyped speaks protocol v2, see skype_parse_framing(). */
+	int framing;
+	/* Id of the last request we sent as a frame. */
+	guint32 request_id;
+	/* Request id of the frame being parsed, 0 for events and in the line
+	 * protocol. */
+	guint32 reply_id;
+	/* The link feature we are waiting for skyped to accept or ignore,
+	 * 0 before login and SKYPE_NEGOTIATE_DONE afterwards. */
+	int negotiate;
+	gint negotiate_timeout;
+	/* Commands held back while negotiating, char*, one per call of
+	 * skype_write_now(). NULL if not waiting. */
+	GQueue *held;
+	/* Bulk commands waiting to be sent, struct skype_request*. */
+	GQueue *bulk;
+	/* Sent bulk commands we still expect a reply for. */
+	GList *inflight;
+	/* Timer expiring unanswered bulk commands, 0 if none are sent. */
+	gint inflight_sweep;
+	/* Both of the above, keyed by the command, so the same query isn't
+	 * sent again while it's running. */
+	GHashTable *pending;
+	/* Number of commands dropped because of that, for the stats
+	 * command. */
+	guint64 deduplicated;
+	/* Same for commands cancelled by skype_cancel(). */
+	guint64 cancelled;
+	/* Token bucket limiting the bulk commands, see skype_pump(). */
+	double tokens;
+	/* When the bucket was last refilled, 0 if it's full. */
+	gint64 tokens_at;
+	/* Tokens per second, below bulk_rate while the adaptive mode backs
+	 * off, 0 if unlimited. */
+	double rate;
+	/* When the adaptive mode last halved the rate. Slow replies to
+	 * commands sent before that don't count again. */
+	gint64 rate_cut_at;
+	/* Timer waiting for the next token, 0 if not waiting. */
+	gint pump_id;
+	/* Reply latency of bulk commands in milliseconds, moving average. */
+	double bulk_latency;
+	/* Timer sending our PINGs, 0 if heartbeats are off. */
+	gint heartbeat_id;
+	/* When the outstanding PING was sent (monotonic, in microseconds),
+	 * 0 if none. */
+	gint64 ping_sent;
+	/* Heartbeats that passed while a PING was unanswered. */
+	int ping_misses;
+	/* An old skyped swallows our PINGs, so only count misses once it has
+	 * answered one. */
+	int pong_seen;
+	/* Round trip times in milliseconds, to skyped. */
+	double rtt;
+	double rtt_max;
+	/* Bytes before compression and on the wire, for the stats command. */
+	guint64 rx_bytes;
+	guint64 rx_wire;
+	guint64 tx_bytes;
+	guint64 tx_wire;
 	/* When we receive a new message id, we query the properties, finally
 	 * the chatname. Store the properties here so that we can use
 	 * imcb_buddy_msg() when we got the chatname. */
@@ -71,18 +205,15 @@ struct skype_data {
 	/* List, because of multiline messages. */
 	GList *body;
 	char *type;
-	/* This is necessary because we send a notification when we get the
-	 * handle. So we store the state here and then we can send a
-	 * notification about the handle is in a given status. */
-	int call_status;
-	char *call_id;
-	char *call_duration;
-	/* If the call is outgoing or not */
-	int call_out;
-	/* Same for file transfers. */
-	int filetransfer_status;
-	/* Path of the file being transferred. */
-	char *filetransfer_path;
+	/* Calls we know about, struct skype_call* keyed by call id. Entries
+	 * are removed once the call reaches a terminal status. */
+	GHashTable *calls;
+	/* Same for file transfers, struct skype_filetransfer* keyed by id. */
+	GHashTable *filetransfers;
+	/* Timer polling the progress of active transfers, 0 if idle. */
+	gint filetransfer_poll;
+	/* List of struct skype_relay*, transfers we forward to the user. */
+	GList *relays;
 	/* Using /j #nick we want to have a groupchat with two people. Usually
 	 * not (default). */
 	char *groupchat_with;
@@ -90,25 +221,11 @@ struct skype_data {
 	char *adder;
 	/* If we are waiting for a confirmation about we changed the topic. */
 	int topic_wait;
-	/* These are used by the info command. */
-	char *info_fullname;
-	char *info_phonehome;
-	char *info_phoneoffice;
-	char *info_phonemobile;
-	char *info_nrbuddies;
-	char *info_tz;
-	char *info_seen;
-	char *info_birthday;
-	char *info_sex;
-	char *info_language;
-	char *info_country;
-	char *info_province;
-	char *info_city;
-	char *info_homepage;
-	char *info_about;
-	/* When a call fails, we get the reason and later we get the failure
-	 * event, so store the failure code here till then */
-	int failurereason;
+	/* Running info commands, struct skype_info_request* keyed by handle. */
+	GHashTable *info_requests;
+	/* Recent info command results, struct skype_info_cached* keyed by
+	 * handle. */
+	GHashTable *info_cache;
 	/* If this is just an update of an already received message. */
 	int is_edit;
 	/* List of struct skype_group* */
@@ -116,8 +233,26 @@ struct skype_data {
 	/* Pending user which has to be added to the next group which is
 	 * created. */
 	char *pending_user;
-	/* If the info command was used, to determine what to do with FULLNAME result. */
-	int is_info;
+};
+
+/* A bulk command, see skype_write(). */
+struct skype_request {
+	/* Without the newline. */
+	char *cmd;
+	/* What its reply starts with in the line protocol, NULL if we can't
+	 * tell. */
+	char *reply;
+	/* The object it's about, like "CHAT name" or "USER handle", or
+	 * "INFO handle" for an info command, NULL if none. See
+	 * skype_cancel(). */
+	char *tag;
+	/* If the object was abandoned while this was running, so the reply
+	 * is to be ignored. */
+	int cancelled;
+	/* Request id of the frame, if sent with protocol v2. */
+	guint32 id;
+	/* When it was sent (monotonic, in microseconds). */
+	gint64 sent;
 };
 
 struct skype_away_state {
@@ -131,6 +266,70 @@ struct skype_buddy_ask_data {
 	char *handle;
 };
 
+struct skype_call {
+	char *id;
+	/* Queried once per call, NULL until the reply arrives. */
+	char *partner;
+	/* This is necessary because we send a notification when we get the
+	 * handle. So we store the statuses here until then, oldest first, as
+	 * ints. Empty if all of them have been reported. */
+	GList *statuses;
+	char *duration;
+	/* If the call is outgoing or not */
+	int out;
+	/* When a call fails, we get the reason and later we get the failure
+	 * event, so store the failure code here till then */
+	int failurereason;
+};
+
+struct skype_filetransfer {
+	char *id;
+	/* Both queried once per transfer, NULL until the reply arrives. */
+	char *partner;
+	char *path;
+	/* The statuses we still have to report, oldest first, as ints. */
+	GList *statuses;
+	/* If we are currently receiving data, so it's worth polling. */
+	int active;
+	/* When the transfer started, to report the average throughput. */
+	time_t started;
+	guint64 size;
+	guint64 bytes;
+	guint64 bps;
+	/* Set if the file is forwarded to the user, see filetransfer_relay. */
+	struct skype_relay *relay;
+	/* Set if forwarding failed, so we don't try again. */
+	int relay_failed;
+};
+
+struct skype_relay {
+	struct im_connection *ic;
+	file_transfer_t *ft;
+	/* Id of the Skype transfer, which may be gone before we finish. */
+	char *id;
+	int fd;
+	guint64 offset;
+	/* If Skype finished writing the file, so EOF is really the end. */
+	int complete;
+	/* Timer waiting for Skype to write more data, 0 if not waiting. */
+	gint retry;
+	char buf[SKYPE_RELAY_CHUNK];
+};
+
+/* The properties collected for a single info command. */
+struct skype_info_request {
+	char *handle;
+	/* One value per entry of skype_info_fields, NULL if not received. */
+	char **values;
+	/* When we asked, see skype_get_info(). */
+	time_t time;
+};
+
+struct skype_info_cached {
+	char *text;
+	time_t time;
+};
+
 struct skype_group {
 	int id;
 	char *name;
@@ -152,34 +351,612 @@ const struct skype_away_state skype_away_state_list[] = {
 	{ NULL, NULL }
 };
 
+typedef void (*skype_info_formatter)(GString *st, const char *label, char *value);
+
+static void skype_info_format_plain(GString *st, const char *label, char *value)
+{
+	if (label) {
+		g_string_append_printf(st, "%s: %s\n", label, value);
+	} else {
+		g_string_append_printf(st, "%s\n", value);
+	}
+}
+
+static void skype_info_format_timezone(GString *st, const char *label, char *value)
+{
+	char ib[256];
+	time_t t = time(NULL);
+	struct tm *gt;
+
+	t += atoi(value) - (60 * 60 * 24);
+	gt = gmtime(&t);
+	strftime(ib, 256, "%H:%M:%S", gt);
+	g_string_append_printf(st, "%s: %s\n", label, ib);
+}
+
+static void skype_info_format_timestamp(GString *st, const char *label, char *value)
+{
+	char ib[256];
+	time_t it = atoi(value);
+	struct tm *tm = localtime(&it);
+
+	strftime(ib, 256, ("%Y. %m. %d. %H:%M"), tm);
+	g_string_append_printf(st, "%s: %s\n", label, ib);
+}
+
+static void skype_info_format_birthday(GString *st, const char *label, char *value)
+{
+	char ib[256];
+	struct tm tm;
+	struct tm *lt;
+	time_t t = time(NULL);
+	int year;
+
+	if (!strcmp(value, "0")) {
+		return;
+	}
+	strptime(value, "%Y%m%d", &tm);
+	strftime(ib, 256, "%B %d, %Y", &tm);
+	g_string_append_printf(st, "%s: %s\n", label, ib);
+
+	strftime(ib, 256, "%Y", &tm);
+	year = atoi(ib);
+	lt = localtime(&t);
+	g_string_append_printf(st, "Age: %d\n", lt->tm_year + 1900 - year);
+}
+
+/* "MALE" -> "Male" */
+static void skype_info_format_capitalized(GString *st, const char *label, char *value)
+{
+	char *iptr = value;
+
+	while (*iptr++) {
+		*iptr = g_ascii_tolower(*iptr);
+	}
+	g_string_append_printf(st, "%s: %s\n", label, value);
+}
+
+/* "en English" -> "English" */
+static void skype_info_format_name(GString *st, const char *label, char *value)
+{
+	char *iptr = strchr(value, ' ');
+
+	if (iptr) {
+		iptr++;
+	} else {
+		iptr = value;
+	}
+	g_string_append_printf(st, "%s: %s\n", label, iptr);
+}
+
+/* The properties shown by the info command, in display order. */
+static const struct skype_info_field {
+	char *property;
+	/* Heading printed before this field, even if it's empty. */
+	char *section;
+	char *label;
+	skype_info_formatter format;
+	/* If the value may span several lines, which arrive one by one. */
+	int multiline;
+} skype_info_fields[] = {
+	{ "FULLNAME", NULL, "Full Name", skype_info_format_plain },
+	{ "PHONE_HOME", NULL, "Home Phone", skype_info_format_plain },
+	{ "PHONE_OFFICE", NULL, "Office Phone", skype_info_format_plain },
+	{ "PHONE_MOBILE", NULL, "Mobile Phone", skype_info_format_plain },
+	{ "NROF_AUTHED_BUDDIES", "Personal Information", "Contacts",
+	  skype_info_format_plain },
+	{ "TIMEZONE", NULL, "Local Time", skype_info_format_timezone },
+	{ "LASTONLINETIMESTAMP", NULL, "Last Seen",
+	  skype_info_format_timestamp },
+	{ "BIRTHDAY", NULL, "Birthday", skype_info_format_birthday },
+	{ "SEX", NULL, "Gender", skype_info_format_capitalized },
+	{ "LANGUAGE", NULL, "Language", skype_info_format_name },
+	{ "COUNTRY", NULL, "Country", skype_info_format_name },
+	{ "PROVINCE", NULL, "Region", skype_info_format_plain },
+	{ "CITY", NULL, "City", skype_info_format_plain },
+	{ "HOMEPAGE", NULL, "Homepage", skype_info_format_plain },
+	{ "ABOUT", NULL, NULL, skype_info_format_plain, TRUE },
+};
+
 /*
  * Functions
  */
 
-int skype_write(struct im_connection *ic, char *buf, int len)
+static void skype_link_lost(struct im_connection *ic);
+static void skype_logout_later(struct im_connection *ic);
+
+/* Transport helpers: TLS over TCP, or a plain unix socket. */
+
+static int skype_sock_read(struct skype_data *sd, char *buf, int len)
+{
+	if (sd->ssl) {
+		return ssl_read(sd->ssl, buf, len);
+	}
+	return read(sd->fd, buf, len);
+}
+
+static int skype_sock_write(struct skype_data *sd, const char *buf, int len)
+{
+	if (sd->ssl) {
+		return ssl_write(sd->ssl, buf, len);
+	}
+	return write(sd->fd, buf, len);
+}
+
+static gboolean skype_sock_again(struct skype_data *sd)
+{
+	if (sd->ssl) {
+		return ssl_sockerr_again(sd->ssl);
+	}
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+/* Write the whole buffer to the socket, waiting for it if it's full. */
+static gboolean skype_write_raw(struct im_connection *ic, const char *buf, int len)
 {
 	struct skype_data *sd = ic->proto_data;
 	struct pollfd pfd[1];
+	int st, tries = 0;
+
+	while (len > 0) {
+		pfd[0].fd = sd->fd;
+		pfd[0].events = POLLOUT;
+
+		/* This poll is necessary or we'll get a SIGPIPE when we write() to
+		 * sd->fd. */
+		poll(pfd, 1, 1000);
+		if (pfd[0].revents & POLLHUP) {
+			skype_link_lost(ic);
+			return FALSE;
+		}
+		st = skype_sock_write(sd, buf, len);
+		if (st < 0 && skype_sock_again(sd) && ++tries < 10) {
+			continue;
+		}
+		if (st <= 0) {
+			/* Part of a line (or of the compressed stream) is lost,
+			 * better start over. */
+			imcb_error(ic, "Error while writing to server");
+			skype_link_lost(ic);
+			return FALSE;
+		}
+		sd->tx_wire += st;
+		buf += st;
+		len -= st;
+		tries = 0;
+	}
+
+	return TRUE;
+}
+
+static gboolean skype_deflate(struct im_connection *ic, char *buf, int len)
+{
+	struct skype_data *sd = ic->proto_data;
+	char out[IRC_LINE_SIZE];
+
+	sd->zout.next_in = (Bytef *) buf;
+	sd->zout.avail_in = len;
+	do {
+		sd->zout.next_out = (Bytef *) out;
+		sd->zout.avail_out = sizeof(out);
+		/* Keep the dictionary, but let skyped see each write now. */
+		deflate(&sd->zout, Z_SYNC_FLUSH);
+		if (!skype_write_raw(ic, out, sizeof(out) - sd->zout.avail_out)) {
+			return FALSE;
+		}
+	} while (sd->zout.avail_out == 0);
+
+	return TRUE;
+}
 
-	if (!sd->ssl) {
+/* Send data as it is, only compressing it if the link is compressed. */
+static gboolean skype_send(struct im_connection *ic, char *buf, int len)
+{
+	struct skype_data *sd = ic->proto_data;
+
+	sd->tx_bytes += len;
+	if (sd->compress) {
+		return skype_deflate(ic, buf, len);
+	}
+	return skype_write_raw(ic, buf, len);
+}
+
+static void skype_frame_append(struct skype_data *sd, GString *out,
+                               const char *buf, int len)
+{
+	guint32 hdr[2];
+
+	hdr[0] = htonl(len);
+	hdr[1] = htonl(++sd->request_id);
+	g_string_append_len(out, (char *) hdr, sizeof(hdr));
+	g_string_append_len(out, buf, len);
+}
+
+static gboolean skype_write_now(struct im_connection *ic, char *buf, int len)
+{
+	struct skype_data *sd = ic->proto_data;
+	GString *out;
+	gboolean st;
+
+	if (sd->fd < 0) {
 		return FALSE;
 	}
+	if (sd->held) {
+		/* Whole commands, each of them becomes a frame later. */
+		g_queue_push_tail(sd->held, g_strndup(buf, len));
+		return TRUE;
+	}
+	if (!sd->framing) {
+		return skype_send(ic, buf, len);
+	}
+	/* A single command per call, so a multi-line payload stays in one
+	 * frame. */
+	if (len > 0 && buf[len - 1] == '\n') {
+		len--;
+	}
+	out = g_string_sized_new(SKYPE_FRAME_HEADER + len);
+	skype_frame_append(sd, out, buf, len);
+	st = skype_send(ic, out->str, out->len);
+	g_string_free(out, TRUE);
+	return st;
+}
 
-	pfd[0].fd = sd->fd;
-	pfd[0].events = POLLOUT;
+/* Commands fetching roster, group and chat metadata, which may wait behind
+ * each other. Anything not listed (messages, calls, file transfers) is
+ * interactive and goes out right away. */
+static const struct skype_lane {
+	char *prefix;
+	int lane;
+	/* The reply of a bulk command starts with this instead of the
+	 * command itself, if set. */
+	char *reply;
+} skype_lanes[] = {
+	{ "GET USER ", SKYPE_LANE_BULK, NULL },
+	{ "GET GROUP ", SKYPE_LANE_BULK, NULL },
+	{ "GET CHAT ", SKYPE_LANE_BULK, NULL },
+	{ "SEARCH FRIENDS", SKYPE_LANE_BULK, "USERS" },
+	{ "SEARCH GROUPS", SKYPE_LANE_BULK, "GROUPS" },
+	{ "SEARCH ", SKYPE_LANE_BULK, "CHATS" },
+};
 
-	/* This poll is necessary or we'll get a SIGPIPE when we write() to
-	 * sd->fd. */
-	poll(pfd, 1, 1000);
-	if (pfd[0].revents & POLLHUP) {
-		imc_logout(ic, TRUE);
+static void skype_request_free(struct skype_request *req)
+{
+	g_free(req->cmd);
+	g_free(req->reply);
+	g_free(req->tag);
+	g_free(req);
+}
+
+/* Forget a bulk command which is answered or will never be. */
+static void skype_request_done(struct skype_data *sd, struct skype_request *req)
+{
+	/* A cancelled one may have been replaced by a new query already. */
+	if (g_hash_table_lookup(sd->pending, req->cmd) == req) {
+		g_hash_table_remove(sd->pending, req->cmd);
+	}
+	skype_request_free(req);
+}
+
+static gboolean skype_request_sweep(gpointer data, gint fd,
+                                    b_input_condition cond);
+
+static gboolean skype_pump_timeout(gpointer data, gint fd,
+                                   b_input_condition cond);
+
+/* Take a token for a bulk command, if the rate limit allows one now. */
+static gboolean skype_take_token(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	int burst = set_getint(&ic->acc->set, "bulk_burst");
+	int max = set_getint(&ic->acc->set, "bulk_rate");
+	gint64 now = g_get_monotonic_time();
+
+	if (burst < 1) {
+		burst = 1;
+	}
+	if (!set_getbool(&ic->acc->set, "bulk_adaptive") || sd->rate == 0 ||
+	    sd->rate > max) {
+		sd->rate = max;
+	}
+	if (sd->rate <= 0) {
+		return TRUE;
+	}
+	if (!sd->tokens_at) {
+		sd->tokens = burst;
+	} else {
+		sd->tokens += sd->rate * (now - sd->tokens_at) / 1000000.0;
+		if (sd->tokens > burst) {
+			sd->tokens = burst;
+		}
+	}
+	sd->tokens_at = now;
+	if (sd->tokens < 1) {
+		if (!sd->pump_id) {
+			sd->pump_id = b_timeout_add((1 - sd->tokens) * 1000 / sd->rate + 1,
+			                            skype_pump_timeout, ic);
+		}
+		return FALSE;
+	}
+	sd->tokens--;
+	return TRUE;
+}
+
+/* Adaptive mode: halve the rate when skyped gets slow, and slowly go back
+ * up to bulk_rate while it keeps up. */
+static void skype_adapt_rate(struct im_connection *ic,
+                             struct skype_request *req, double latency)
+{
+	struct skype_data *sd = ic->proto_data;
+	int max = set_getint(&ic->acc->set, "bulk_rate");
+
+	sd->bulk_latency = sd->bulk_latency ?
+	                   sd->bulk_latency * 0.875 + latency * 0.125 : latency;
+	if (!set_getbool(&ic->acc->set, "bulk_adaptive") || max <= 0) {
+		return;
+	}
+	if (latency > SKYPE_BULK_LATENCY) {
+		if (req->sent > sd->rate_cut_at && sd->rate > 1) {
+			sd->rate /= 2;
+			if (sd->rate < 1) {
+				sd->rate = 1;
+			}
+			sd->rate_cut_at = g_get_monotonic_time();
+		}
+	} else if (sd->rate < max) {
+		sd->rate += 1 / sd->rate;
+		if (sd->rate > max) {
+			sd->rate = max;
+		}
+	}
+}
+
+/* Send queued bulk commands while there is room in the window and the rate
+ * limit allows it. */
+static void skype_pump(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	struct skype_request *req;
+	char *line;
+	/* Bulk commands sent to skyped but not answered yet, at most. */
+	int window = MAX(set_getint(&ic->acc->set, "bulk_window"), 1);
+
+	while (sd->fd >= 0 && !sd->held && !g_queue_is_empty(sd->bulk) &&
+	       g_list_length(sd->inflight) < window &&
+	       skype_take_token(ic)) {
+		req = g_queue_pop_head(sd->bulk);
+		line = g_strdup_printf("%s\n", req->cmd);
+		sd->inflight = g_list_append(sd->inflight, req);
+		req->sent = g_get_monotonic_time();
+		if (!skype_write_now(ic, line, strlen(line))) {
+			g_free(line);
+			return;
+		}
+		g_free(line);
+		req->id = sd->framing ? sd->request_id : 0;
+	}
+	if (sd->inflight && !sd->inflight_sweep) {
+		sd->inflight_sweep = b_timeout_add(1000, skype_request_sweep, ic);
+	}
+}
+
+static gboolean skype_pump_timeout(gpointer data, gint fd,
+                                   b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+
+	/* Unused parameters */
+	fd = fd;
+	cond = cond;
+
+	sd->pump_id = 0;
+	skype_pump(ic);
+	return FALSE;
+}
+
+static gboolean skype_request_sweep(gpointer data, gint fd,
+                                    b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+	gint64 now = g_get_monotonic_time();
+	GList *l, *next;
+
+	/* Unused parameters */
+	fd = fd;
+	cond = cond;
+
+	for (l = sd->inflight; l; l = next) {
+		struct skype_request *req = l->data;
+
+		next = l->next;
+		if (now - req->sent >= SKYPE_REQUEST_TIMEOUT * 1000000LL) {
+			/* Skype didn't even fail it, surely it's slow. */
+			skype_adapt_rate(ic, req, (now - req->sent) / 1000.0);
+			sd->inflight = g_list_delete_link(sd->inflight, l);
+			skype_request_done(sd, req);
+		}
+	}
+	if (!sd->inflight) {
+		sd->inflight_sweep = 0;
+		skype_pump(ic);
+		return FALSE;
+	}
+	skype_pump(ic);
+	return TRUE;
+}
+
+/* Mark the bulk command a received line answers as done. Returns TRUE if
+ * the line is to be ignored, as the command was cancelled meanwhile. Only
+ * with protocol v2: in the line protocol a notification about the same
+ * object looks just like the reply, so it's parsed as usual. */
+static gboolean skype_request_reply(struct im_connection *ic, char *line)
+{
+	struct skype_data *sd = ic->proto_data;
+	gboolean cancelled;
+	GList *l;
+
+	if (!sd->reply_id && sd->inflight && !strncmp(line, "ERROR ", 6)) {
+		/* The line protocol doesn't tell which command failed, so
+		 * assume the oldest one, rather than keeping its slot until
+		 * the timeout. At worst (an interactive command failed) that
+		 * one is sent a bit early. */
+		skype_request_done(sd, sd->inflight->data);
+		sd->inflight = g_list_delete_link(sd->inflight, sd->inflight);
+		return FALSE;
+	}
+	for (l = sd->inflight; l; l = l->next) {
+		struct skype_request *req = l->data;
+
+		if (sd->reply_id ? req->id == sd->reply_id :
+		    req->reply && !g_ascii_strncasecmp(line, req->reply,
+		                                       strlen(req->reply))) {
+			sd->inflight = g_list_delete_link(sd->inflight, l);
+			skype_adapt_rate(ic, req, (g_get_monotonic_time() -
+			                           req->sent) / 1000.0);
+			cancelled = req->cancelled && sd->reply_id;
+			skype_request_done(sd, req);
+			return cancelled;
+		}
+	}
+	return FALSE;
+}
+
+/* Drop the queued bulk commands about an object the user abandoned, and
+ * ignore the replies of the running ones. */
+static void skype_cancel(struct im_connection *ic, const char *type,
+                         const char *id)
+{
+	struct skype_data *sd = ic->proto_data;
+	char *tag = g_strdup_printf("%s %s", type, id);
+	GList *l, *next;
+
+	for (l = g_queue_peek_head_link(sd->bulk); l; l = next) {
+		struct skype_request *req = l->data;
+
+		next = l->next;
+		if (req->tag && !strcmp(req->tag, tag)) {
+			g_queue_delete_link(sd->bulk, l);
+			skype_request_done(sd, req);
+			sd->cancelled++;
+		}
+	}
+	for (l = sd->inflight; l; l = l->next) {
+		struct skype_request *req = l->data;
+
+		if (req->tag && !strcmp(req->tag, tag) && !req->cancelled) {
+			/* Asking again has to really ask again. */
+			g_hash_table_remove(sd->pending, req->cmd);
+			req->cancelled = TRUE;
+			sd->cancelled++;
+		}
+	}
+	g_free(tag);
+}
+
+/* Forget the bulk commands skyped will never answer, as the link is gone.
+ * The queued ones are still sent after reconnecting. */
+static void skype_request_lost(struct skype_data *sd)
+{
+	if (sd->inflight_sweep) {
+		b_event_remove(sd->inflight_sweep);
+		sd->inflight_sweep = 0;
+	}
+	if (sd->pump_id) {
+		b_event_remove(sd->pump_id);
+		sd->pump_id = 0;
+	}
+	while (sd->inflight) {
+		skype_request_done(sd, sd->inflight->data);
+		sd->inflight = g_list_delete_link(sd->inflight, sd->inflight);
+	}
+}
+
+/* Keep an interactive command (like a message the user sent) while we are
+ * reconnecting, see skype_start_stream(). */
+static gboolean skype_hold(struct im_connection *ic, char *buf, int len)
+{
+	struct skype_data *sd = ic->proto_data;
+
+	if (g_queue_get_length(sd->interactive) >= SKYPE_HELD_MAX) {
+		imcb_error(ic, "Not connected to skyped, command not delivered");
 		return FALSE;
 	}
-	ssl_write(sd->ssl, buf, len);
+	g_queue_push_tail(sd->interactive, g_strndup(buf, len));
+	return TRUE;
+}
 
+/* Interactive commands are sent right away. Bulk ones (metadata fetches)
+ * are queued, and only a few of them are handed to skyped at a time, so
+ * that what the user types doesn't wait behind a login burst. While the
+ * link is down, both wait for it to come back. A bulk command is cancelled
+ * by its tag, by default the object of a GET, see skype_cancel(). */
+static int skype_write_tagged(struct im_connection *ic, char *buf, int len,
+                              const char *tag)
+{
+	struct skype_data *sd = ic->proto_data;
+	const struct skype_lane *lane = NULL;
+	struct skype_request *req, *running;
+	int i;
+
+	if (sd->fd < 0 && !(sd->resync && (ic->flags & OPT_LOGGED_IN))) {
+		return FALSE;
+	}
+	for (i = 0; i < ARRAY_SIZE(skype_lanes); i++) {
+		if (!strncmp(buf, skype_lanes[i].prefix,
+		             strlen(skype_lanes[i].prefix))) {
+			lane = &skype_lanes[i];
+			break;
+		}
+	}
+	if (!lane || lane->lane == SKYPE_LANE_INTERACTIVE) {
+		if (sd->fd < 0) {
+			return skype_hold(ic, buf, len);
+		}
+		return skype_write_now(ic, buf, len);
+	}
+	req = g_new0(struct skype_request, 1);
+	req->cmd = g_strndup(buf, len > 0 && buf[len - 1] == '\n' ? len - 1 : len);
+	if (tag) {
+		req->tag = g_strdup(tag);
+	} else if (!strncmp(req->cmd, "GET ", 4)) {
+		/* "GET CHAT name ACTIVEMEMBERS" -> "CHAT name" */
+		char *end = strchr(req->cmd + 4, ' ');
+
+		if (end && (end = strchr(end + 1, ' '))) {
+			req->tag = g_strndup(req->cmd + 4, end - req->cmd - 4);
+		}
+	}
+	running = g_hash_table_lookup(sd->pending, req->cmd);
+	if (running) {
+		/* Its reply is parsed like any other line, so the one
+		 * already queued or sent does the job for both callers. */
+		if (g_strcmp0(running->tag, req->tag)) {
+			/* Then neither of them may cancel it. */
+			g_free(running->tag);
+			running->tag = NULL;
+		}
+		sd->deduplicated++;
+		skype_request_free(req);
+		return TRUE;
+	}
+	g_hash_table_insert(sd->pending, req->cmd, req);
+	if (lane->reply) {
+		req->reply = g_strdup(lane->reply);
+	} else {
+		/* "GET USER x FULLNAME" -> "USER x FULLNAME ..." */
+		req->reply = g_strdup(req->cmd + 4);
+	}
+	g_queue_push_tail(sd->bulk, req);
+	skype_pump(ic);
 	return TRUE;
 }
 
+int skype_write(struct im_connection *ic, char *buf, int len)
+{
+	return skype_write_tagged(ic, buf, len, NULL);
+}
+
 int skype_printf(struct im_connection *ic, char *fmt, ...)
 {
 	va_list args;
@@ -342,36 +1119,134 @@ static struct groupchat *skype_chat_get_or_create(struct im_connection *ic, char
 
 static void skype_parse_users(struct im_connection *ic, char *line)
 {
+	struct skype_data *sd = ic->proto_data;
 	char **i, **nicks;
 
 	nicks = g_strsplit(line + 6, ", ", 0);
 	for (i = nicks; *i; i++) {
 		skype_printf(ic, "GET USER %s ONLINESTATUS\n", *i);
-		skype_printf(ic, "GET USER %s FULLNAME\n", *i);
+		/* After a reconnect we only care about the presence of the
+		 * buddies we already know. */
+		if (!sd->resync || !bee_user_by_handle(ic->bee, ic, *i)) {
+			skype_printf(ic, "GET USER %s FULLNAME\n", *i);
+		}
 	}
 	g_strfreev(nicks);
 }
 
-static void skype_parse_user(struct im_connection *ic, char *line)
+static void skype_info_request_free(gpointer data)
 {
-	int flags = 0;
-	char *ptr;
-	struct skype_data *sd = ic->proto_data;
-	char *user = strchr(line, ' ');
-	char *status = strrchr(line, ' ');
+	struct skype_info_request *info = data;
+	int i;
 
-	status++;
-	ptr = strchr(++user, ' ');
-	if (!ptr) {
-		return;
+	for (i = 0; i < ARRAY_SIZE(skype_info_fields); i++) {
+		g_free(info->values[i]);
 	}
-	*ptr = '\0';
-	ptr++;
-	if (!strncmp(ptr, "ONLINESTATUS ", 13)) {
-		if (!strlen(user) || !strcmp(user, sd->username)) {
-			return;
-		}
-		if (!set_getbool(&ic->acc->set, "test_join")
+	g_free(info->values);
+	g_free(info->handle);
+	g_free(info);
+}
+
+static void skype_info_cached_free(gpointer data)
+{
+	struct skype_info_cached *cached = data;
+
+	g_free(cached->text);
+	g_free(cached);
+}
+
+static gboolean skype_info_cached_expired(gpointer key, gpointer value, gpointer data)
+{
+	struct skype_info_cached *cached = value;
+	time_t *now = data;
+
+	/* Unused parameter */
+	key = key;
+
+	return cached->time + SKYPE_INFO_TTL < *now;
+}
+
+/* Show the collected properties to the user and remember them for a while,
+ * so that repeated info commands can be answered locally. */
+static void skype_info_flush(struct im_connection *ic, struct skype_info_request *info)
+{
+	struct skype_data *sd = ic->proto_data;
+	struct skype_info_cached *cached;
+	time_t now = time(NULL);
+	GString *st = g_string_new("Contact Information\n");
+	int i;
+
+	g_string_append_printf(st, "Skype Name: %s\n", info->handle);
+	for (i = 0; i < ARRAY_SIZE(skype_info_fields); i++) {
+		const struct skype_info_field *field = skype_info_fields + i;
+
+		if (field->section) {
+			g_string_append_printf(st, "%s\n", field->section);
+		}
+		if (info->values[i] && strlen(info->values[i])) {
+			field->format(st, field->label, info->values[i]);
+		}
+	}
+	imcb_log(ic, "%s", st->str);
+
+	g_hash_table_foreach_remove(sd->info_cache, skype_info_cached_expired,
+	                            &now);
+	cached = g_new0(struct skype_info_cached, 1);
+	cached->time = now;
+	cached->text = g_string_free(st, FALSE);
+	g_hash_table_replace(sd->info_cache, g_strdup(info->handle), cached);
+}
+
+/* Store a property we got for an info command. Returns TRUE if this was the
+ * last one we asked for. */
+static gboolean skype_info_store(struct skype_info_request *info, char *line)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(skype_info_fields); i++) {
+		const char *property = skype_info_fields[i].property;
+		int len = strlen(property);
+		char *value;
+
+		if (strncmp(line, property, len) || line[len] != ' ') {
+			continue;
+		}
+		value = line + len + 1;
+		if (!info->values[i]) {
+			info->values[i] = g_strdup(value);
+		} else if (skype_info_fields[i].multiline) {
+			char *buf = g_strdup_printf("%s\n%s", info->values[i],
+			                            value);
+			g_free(info->values[i]);
+			info->values[i] = buf;
+		}
+		return !strcmp(property, SKYPE_INFO_LAST);
+	}
+	return FALSE;
+}
+
+static void skype_parse_user(struct im_connection *ic, char *line)
+{
+	int flags = 0;
+	char *ptr;
+	struct skype_data *sd = ic->proto_data;
+	struct skype_info_request *info;
+	char *user = strchr(line, ' ');
+	char *status = strrchr(line, ' ');
+
+	status++;
+	ptr = strchr(++user, ' ');
+	if (!ptr) {
+		return;
+	}
+	*ptr = '\0';
+	ptr++;
+	info = g_hash_table_lookup(sd->info_requests, user);
+	if (!strncmp(ptr, "ONLINESTATUS ", 13)) {
+		if (!strlen(user) || !strcmp(user, sd->username)) {
+			return;
+		}
+		if (!set_getbool(&ic->acc->set, "test_join")
 		    && !strcmp(user, "echo123")) {
 			return;
 		}
@@ -412,324 +1287,639 @@ static void skype_parse_user(struct im_connection *ic, char *line)
 		}
 	} else if (!strncmp(ptr, "FULLNAME ", 9)) {
 		char *name = ptr + 9;
-		if (sd->is_info) {
-			sd->is_info = FALSE;
-			sd->info_fullname = g_strdup(name);
+		char *buf = g_strdup_printf("%s", user);
+		imcb_rename_buddy(ic, buf, name);
+		g_free(buf);
+		if (info) {
+			skype_info_store(info, ptr);
+		}
+	} else if (info && skype_info_store(info, ptr)) {
+		skype_info_flush(ic, info);
+		g_hash_table_remove(sd->info_requests, user);
+	}
+}
+
+static void skype_parse_chatmessage_said_emoted(struct im_connection *ic, struct groupchat *gc, char *body)
+{
+	struct skype_data *sd = ic->proto_data;
+	char buf[IRC_LINE_SIZE];
+
+	if (!strcmp(sd->type, "SAID")) {
+		if (!sd->is_edit) {
+			g_snprintf(buf, IRC_LINE_SIZE, "%s", body);
 		} else {
-			char *buf = g_strdup_printf("%s", user);
-			imcb_rename_buddy(ic, buf, name);
-			g_free(buf);
+			g_snprintf(buf, IRC_LINE_SIZE, "%s %s", set_getstr(&ic->acc->set, "edit_prefix"), body);
+			sd->is_edit = 0;
 		}
-	} else if (!strncmp(ptr, "PHONE_HOME ", 11)) {
-		sd->info_phonehome = g_strdup(ptr + 11);
-	} else if (!strncmp(ptr, "PHONE_OFFICE ", 13)) {
-		sd->info_phoneoffice = g_strdup(ptr + 13);
-	} else if (!strncmp(ptr, "PHONE_MOBILE ", 13)) {
-		sd->info_phonemobile = g_strdup(ptr + 13);
-	} else if (!strncmp(ptr, "NROF_AUTHED_BUDDIES ", 20)) {
-		sd->info_nrbuddies = g_strdup(ptr + 20);
-	} else if (!strncmp(ptr, "TIMEZONE ", 9)) {
-		sd->info_tz = g_strdup(ptr + 9);
-	} else if (!strncmp(ptr, "LASTONLINETIMESTAMP ", 20)) {
-		sd->info_seen = g_strdup(ptr + 20);
-	} else if (!strncmp(ptr, "SEX ", 4)) {
-		sd->info_sex = g_strdup(ptr + 4);
-	} else if (!strncmp(ptr, "LANGUAGE ", 9)) {
-		sd->info_language = g_strdup(ptr + 9);
-	} else if (!strncmp(ptr, "COUNTRY ", 8)) {
-		sd->info_country = g_strdup(ptr + 8);
-	} else if (!strncmp(ptr, "PROVINCE ", 9)) {
-		sd->info_province = g_strdup(ptr + 9);
-	} else if (!strncmp(ptr, "CITY ", 5)) {
-		sd->info_city = g_strdup(ptr + 5);
-	} else if (!strncmp(ptr, "HOMEPAGE ", 9)) {
-		sd->info_homepage = g_strdup(ptr + 9);
-	} else if (!strncmp(ptr, "ABOUT ", 6)) {
-		/* Support multiple about lines. */
-		if (!sd->info_about) {
-			sd->info_about = g_strdup(ptr + 6);
+	} else {
+		g_snprintf(buf, IRC_LINE_SIZE, "/me %s", body);
+	}
+	if (!gc) {
+		/* Private message */
+		imcb_buddy_msg(ic, sd->handle, buf, 0, 0);
+	} else {
+		/* Groupchat message */
+		imcb_chat_msg(gc, sd->handle, buf, 0, 0);
+	}
+}
+
+static void skype_parse_chatmessage(struct im_connection *ic, char *line)
+{
+	struct skype_data *sd = ic->proto_data;
+	char *id = strchr(line, ' ');
+
+	if (!++id) {
+		return;
+	}
+	char *info = strchr(id, ' ');
+
+	if (!info) {
+		return;
+	}
+	*info = '\0';
+	info++;
+	if (!strcmp(info, "STATUS RECEIVED") || !strncmp(info, "EDITED_TIMESTAMP", 16)) {
+		/* New message ID:
+		 * (1) Request its from field
+		 * (2) Request its body
+		 * (3) Request its type
+		 * (4) Query chatname
+		 */
+		skype_printf(ic, "GET CHATMESSAGE %s FROM_HANDLE\n", id);
+		if (!strcmp(info, "STATUS RECEIVED")) {
+			skype_printf(ic, "GET CHATMESSAGE %s BODY\n", id);
 		} else {
-			GString *st = g_string_new(sd->info_about);
-			g_string_append_printf(st, "\n%s", ptr + 6);
-			g_free(sd->info_about);
-			sd->info_about = g_strdup(st->str);
-			g_string_free(st, TRUE);
-		}
-	} else if (!strncmp(ptr, "BIRTHDAY ", 9)) {
-		sd->info_birthday = g_strdup(ptr + 9);
-
-		GString *st = g_string_new("Contact Information\n");
-		g_string_append_printf(st, "Skype Name: %s\n", user);
-		if (sd->info_fullname) {
-			if (strlen(sd->info_fullname)) {
-				g_string_append_printf(st, "Full Name: %s\n",
-				                       sd->info_fullname);
-			}
-			g_free(sd->info_fullname);
-			sd->info_fullname = NULL;
+			sd->is_edit = 1;
 		}
-		if (sd->info_phonehome) {
-			if (strlen(sd->info_phonehome)) {
-				g_string_append_printf(st, "Home Phone: %s\n",
-				                       sd->info_phonehome);
+		skype_printf(ic, "GET CHATMESSAGE %s TYPE\n", id);
+		skype_printf(ic, "GET CHATMESSAGE %s CHATNAME\n", id);
+	} else if (!strncmp(info, "FROM_HANDLE ", 12)) {
+		info += 12;
+		/* New from field value. Store
+		 * it, then we can later use it
+		 * when we got the message's
+		 * body. */
+		g_free(sd->handle);
+		sd->handle = g_strdup_printf("%s", info);
+	} else if (!strncmp(info, "EDITED_BY ", 10)) {
+		info += 10;
+		/* This is the same as
+		 * FROM_HANDLE, except that we
+		 * never request these lines
+		 * from Skype, we just get
+		 * them. */
+		g_free(sd->handle);
+		sd->handle = g_strdup_printf("%s", info);
+	} else if (!strncmp(info, "BODY ", 5)) {
+		info += 5;
+		sd->body = g_list_append(sd->body, g_strdup(info));
+	} else if (!strncmp(info, "TYPE ", 5)) {
+		info += 5;
+		g_free(sd->type);
+		sd->type = g_strdup(info);
+	} else if (!strncmp(info, "CHATNAME ", 9)) {
+		info += 9;
+		if (sd->handle && sd->body && sd->type) {
+			struct groupchat *gc = skype_chat_get_or_create(ic, info);
+			int i;
+			for (i = 0; i < g_list_length(sd->body); i++) {
+				char *body = g_list_nth_data(sd->body, i);
+				if (!strcmp(sd->type, "SAID") ||
+				    !strcmp(sd->type, "EMOTED")) {
+					skype_parse_chatmessage_said_emoted(ic, gc, body);
+				} else if (!strcmp(sd->type, "SETTOPIC") && gc) {
+					imcb_chat_topic(gc,
+					                sd->handle, body, 0);
+				} else if (!strcmp(sd->type, "LEFT") && gc) {
+					imcb_chat_remove_buddy(gc,
+					                       sd->handle, NULL);
+				}
 			}
-			g_free(sd->info_phonehome);
-			sd->info_phonehome = NULL;
+			g_list_free(sd->body);
+			sd->body = NULL;
 		}
-		if (sd->info_phoneoffice) {
-			if (strlen(sd->info_phoneoffice)) {
-				g_string_append_printf(st, "Office Phone: %s\n",
-				                       sd->info_phoneoffice);
-			}
-			g_free(sd->info_phoneoffice);
-			sd->info_phoneoffice = NULL;
+	}
+}
+
+static void skype_call_free(gpointer data)
+{
+	struct skype_call *call = data;
+
+	g_free(call->id);
+	g_free(call->partner);
+	g_free(call->duration);
+	g_list_free(call->statuses);
+	g_free(call);
+}
+
+static struct skype_call *skype_call_get_or_create(struct im_connection *ic, char *id)
+{
+	struct skype_data *sd = ic->proto_data;
+	struct skype_call *call = g_hash_table_lookup(sd->calls, id);
+
+	if (!call) {
+		call = g_new0(struct skype_call, 1);
+		call->id = g_strdup(id);
+		g_hash_table_insert(sd->calls, call->id, call);
+		skype_printf(ic, "GET CALL %s PARTNER_HANDLE\n", id);
+	}
+
+	return call;
+}
+
+/* Tell the user about a status of the call. A ringing which is already
+ * followed by another status is only logged, there is nothing to answer
+ * anymore. Returns TRUE if the status is a terminal one. */
+static gboolean skype_call_report_status(struct im_connection *ic, struct skype_call *call,
+                                         int status, int last)
+{
+	char buf[IRC_LINE_SIZE];
+
+	switch (status) {
+	case SKYPE_CALL_RINGING:
+		if (call->out) {
+			imcb_log(ic, "You are currently ringing the user %s.",
+			         call->partner);
+		} else if (!last) {
+			imcb_log(ic, "The user %s rang you.", call->partner);
+		} else {
+			g_snprintf(buf, IRC_LINE_SIZE,
+			           "The user %s is currently ringing you.",
+			           call->partner);
+			skype_call_ask(ic, call->id, buf);
 		}
-		if (sd->info_phonemobile) {
-			if (strlen(sd->info_phonemobile)) {
-				g_string_append_printf(st, "Mobile Phone: %s\n",
-				                       sd->info_phonemobile);
-			}
-			g_free(sd->info_phonemobile);
-			sd->info_phonemobile = NULL;
-		}
-		g_string_append_printf(st, "Personal Information\n");
-		if (sd->info_nrbuddies) {
-			if (strlen(sd->info_nrbuddies)) {
-				g_string_append_printf(st,
-				                       "Contacts: %s\n", sd->info_nrbuddies);
-			}
-			g_free(sd->info_nrbuddies);
-			sd->info_nrbuddies = NULL;
-		}
-		if (sd->info_tz) {
-			if (strlen(sd->info_tz)) {
-				char ib[256];
-				time_t t = time(NULL);
-				t += atoi(sd->info_tz) - (60 * 60 * 24);
-				struct tm *gt = gmtime(&t);
-				strftime(ib, 256, "%H:%M:%S", gt);
-				g_string_append_printf(st,
-				                       "Local Time: %s\n", ib);
-			}
-			g_free(sd->info_tz);
-			sd->info_tz = NULL;
-		}
-		if (sd->info_seen) {
-			if (strlen(sd->info_seen)) {
-				char ib[256];
-				time_t it = atoi(sd->info_seen);
-				struct tm *tm = localtime(&it);
-				strftime(ib, 256, ("%Y. %m. %d. %H:%M"), tm);
-				g_string_append_printf(st,
-				                       "Last Seen: %s\n", ib);
-			}
-			g_free(sd->info_seen);
-			sd->info_seen = NULL;
-		}
-		if (sd->info_birthday) {
-			if (strlen(sd->info_birthday) &&
-			    strcmp(sd->info_birthday, "0")) {
-				char ib[256];
-				struct tm tm;
-				strptime(sd->info_birthday, "%Y%m%d", &tm);
-				strftime(ib, 256, "%B %d, %Y", &tm);
-				g_string_append_printf(st,
-				                       "Birthday: %s\n", ib);
-
-				strftime(ib, 256, "%Y", &tm);
-				int year = atoi(ib);
-				time_t t = time(NULL);
-				struct tm *lt = localtime(&t);
-				g_string_append_printf(st,
-				                       "Age: %d\n", lt->tm_year + 1900 - year);
-			}
-			g_free(sd->info_birthday);
-			sd->info_birthday = NULL;
-		}
-		if (sd->info_sex) {
-			if (strlen(sd->info_sex)) {
-				char *iptr = sd->info_sex;
-				while (*iptr++) {
-					*iptr = g_ascii_tolower(*iptr);
-				}
-				g_string_append_printf(st,
-				                       "Gender: %s\n", sd->info_sex);
-			}
-			g_free(sd->info_sex);
-			sd->info_sex = NULL;
-		}
-		if (sd->info_language) {
-			if (strlen(sd->info_language)) {
-				char *iptr = strchr(sd->info_language, ' ');
-				if (iptr) {
-					iptr++;
-				} else {
-					iptr = sd->info_language;
-				}
-				g_string_append_printf(st,
-				                       "Language: %s\n", iptr);
-			}
-			g_free(sd->info_language);
-			sd->info_language = NULL;
-		}
-		if (sd->info_country) {
-			if (strlen(sd->info_country)) {
-				char *iptr = strchr(sd->info_country, ' ');
-				if (iptr) {
-					iptr++;
-				} else {
-					iptr = sd->info_country;
-				}
-				g_string_append_printf(st,
-				                       "Country: %s\n", iptr);
-			}
-			g_free(sd->info_country);
-			sd->info_country = NULL;
+		return FALSE;
+	case SKYPE_CALL_MISSED:
+		imcb_log(ic, "You have missed a call from user %s.",
+		         call->partner);
+		break;
+	case SKYPE_CALL_CANCELLED:
+		imcb_log(ic, "You cancelled the call to the user %s.",
+		         call->partner);
+		break;
+	case SKYPE_CALL_REFUSED:
+		if (call->out) {
+			imcb_log(ic, "The user %s refused the call.",
+			         call->partner);
+		} else {
+			imcb_log(ic,
+			         "You refused the call from user %s.",
+			         call->partner);
 		}
-		if (sd->info_province) {
-			if (strlen(sd->info_province)) {
-				g_string_append_printf(st,
-				                       "Region: %s\n", sd->info_province);
-			}
-			g_free(sd->info_province);
-			sd->info_province = NULL;
+		break;
+	case SKYPE_CALL_FINISHED:
+		if (call->duration) {
+			imcb_log(ic,
+			         "You finished the call to the user %s "
+			         "(duration: %s seconds).",
+			         call->partner, call->duration);
+		} else {
+			imcb_log(ic,
+			         "You finished the call to the user %s.",
+			         call->partner);
 		}
-		if (sd->info_city) {
-			if (strlen(sd->info_city)) {
-				g_string_append_printf(st,
-				                       "City: %s\n", sd->info_city);
-			}
-			g_free(sd->info_city);
-			sd->info_city = NULL;
+		break;
+	case SKYPE_CALL_BUSY:
+		/* Don't be noisy, just forget about the call. */
+		break;
+	default:
+		/* Don't be noisy, ignore other statuses for now. */
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Tell the user about the pending statuses of the call, once we know who is
+ * on the other end. Returns TRUE if the call reached a terminal status, in
+ * which case the caller should forget about it. */
+static gboolean skype_call_report(struct im_connection *ic, struct skype_call *call)
+{
+	GList *last = g_list_last(call->statuses);
+
+	if (!last) {
+		return FALSE;
+	}
+	if (GPOINTER_TO_INT(last->data) == SKYPE_CALL_FAILED) {
+		/* We got the reason already, no need to wait for the handle. */
+		imcb_error(ic, "Call failed: %s",
+		           skype_call_strerror(call->failurereason));
+		return TRUE;
+	}
+	if (!call->partner) {
+		return FALSE;
+	}
+	while (call->statuses) {
+		int status = GPOINTER_TO_INT(call->statuses->data);
+
+		call->statuses = g_list_delete_link(call->statuses, call->statuses);
+		if (skype_call_report_status(ic, call, status, !call->statuses)) {
+			return TRUE;
 		}
-		if (sd->info_homepage) {
-			if (strlen(sd->info_homepage)) {
-				g_string_append_printf(st,
-				                       "Homepage: %s\n", sd->info_homepage);
+	}
+	return FALSE;
+}
+
+static void skype_parse_call(struct im_connection *ic, char *line)
+{
+	struct skype_data *sd = ic->proto_data;
+	struct skype_call *call;
+	char *id = strchr(line, ' ');
+	static const struct {
+		char *name;
+		int status;
+	} statuses[] = {
+		{ "RINGING", SKYPE_CALL_RINGING },
+		{ "MISSED", SKYPE_CALL_MISSED },
+		{ "CANCELLED", SKYPE_CALL_CANCELLED },
+		{ "FINISHED", SKYPE_CALL_FINISHED },
+		{ "REFUSED", SKYPE_CALL_REFUSED },
+		{ "FAILED", SKYPE_CALL_FAILED },
+		{ "BUSY", SKYPE_CALL_BUSY },
+	};
+
+	if (!++id) {
+		return;
+	}
+	char *info = strchr(id, ' ');
+
+	if (!info) {
+		return;
+	}
+	*info = '\0';
+	info++;
+	if (!strncmp(info, "FAILUREREASON ", 14)) {
+		call = skype_call_get_or_create(ic, id);
+		call->failurereason = atoi(info + 14);
+	} else if (!strncmp(info, "STATUS ", 7)) {
+		int i, status = SKYPE_CALL_ACTIVE;
+		GList *last;
+
+		info += 7;
+		call = skype_call_get_or_create(ic, id);
+		for (i = 0; i < ARRAY_SIZE(statuses); i++) {
+			if (!strcmp(info, statuses[i].name)) {
+				status = statuses[i].status;
+				break;
 			}
-			g_free(sd->info_homepage);
-			sd->info_homepage = NULL;
 		}
-		if (sd->info_about) {
-			if (strlen(sd->info_about)) {
-				g_string_append_printf(st, "%s\n",
-				                       sd->info_about);
-			}
-			g_free(sd->info_about);
-			sd->info_about = NULL;
+		last = g_list_last(call->statuses);
+		if (!last || GPOINTER_TO_INT(last->data) != status) {
+			call->statuses = g_list_append(call->statuses,
+			                               GINT_TO_POINTER(status));
+		}
+		if (!strcmp(info, "UNPLACED")) {
+			/* Save the direction for later usage (Cancel/Finish). */
+			call->out = TRUE;
+		}
+		if (skype_call_report(ic, call)) {
+			g_hash_table_remove(sd->calls, id);
+		}
+	} else if (!strncmp(info, "DURATION ", 9)) {
+		call = g_hash_table_lookup(sd->calls, id);
+		if (call) {
+			g_free(call->duration);
+			call->duration = g_strdup(info + 9);
+		}
+	} else if (!strncmp(info, "PARTNER_HANDLE ", 15)) {
+		info += 15;
+		call = g_hash_table_lookup(sd->calls, id);
+		if (!call) {
+			return;
+		}
+		g_free(call->partner);
+		call->partner = g_strdup(info);
+		if (skype_call_report(ic, call)) {
+			g_hash_table_remove(sd->calls, id);
 		}
-		imcb_log(ic, "%s", st->str);
-		g_string_free(st, TRUE);
 	}
 }
 
-static void skype_parse_chatmessage_said_emoted(struct im_connection *ic, struct groupchat *gc, char *body)
+static void skype_filetransfer_free(gpointer data)
+{
+	struct skype_filetransfer *ft = data;
+
+	g_free(ft->id);
+	g_free(ft->partner);
+	g_free(ft->path);
+	g_list_free(ft->statuses);
+	g_free(ft);
+}
+
+static struct skype_filetransfer *skype_filetransfer_get_or_create(struct im_connection *ic, char *id)
 {
 	struct skype_data *sd = ic->proto_data;
-	char buf[IRC_LINE_SIZE];
+	struct skype_filetransfer *ft = g_hash_table_lookup(sd->filetransfers, id);
 
-	if (!strcmp(sd->type, "SAID")) {
-		if (!sd->is_edit) {
-			g_snprintf(buf, IRC_LINE_SIZE, "%s", body);
+	if (!ft) {
+		ft = g_new0(struct skype_filetransfer, 1);
+		ft->id = g_strdup(id);
+		g_hash_table_insert(sd->filetransfers, ft->id, ft);
+		skype_printf(ic, "GET FILETRANSFER %s PARTNER_HANDLE\n", id);
+		skype_printf(ic, "GET FILETRANSFER %s FILESIZE\n", id);
+	}
+
+	return ft;
+}
+
+static gboolean skype_filetransfer_poll(gpointer data, gint fd,
+                                        b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+	GHashTableIter iter;
+	gpointer value;
+	int n = 0;
+
+	/* Unused parameters */
+	fd = fd;
+	cond = cond;
+
+	g_hash_table_iter_init(&iter, sd->filetransfers);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct skype_filetransfer *ft = value;
+
+		if (!ft->active) {
+			continue;
+		}
+		/* BYTESPERSECOND comes last, we report when we get it. */
+		skype_printf(ic, "GET FILETRANSFER %s BYTESTRANSFERRED\n", ft->id);
+		skype_printf(ic, "GET FILETRANSFER %s BYTESPERSECOND\n", ft->id);
+		n++;
+	}
+	if (!n) {
+		sd->filetransfer_poll = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Start polling if there is something to poll, the timer stops itself once
+ * no transfer is active anymore. */
+static void skype_filetransfer_poll_start(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	int interval = set_getint(&ic->acc->set, "filetransfer_progress");
+
+	if (sd->filetransfer_poll || interval <= 0) {
+		return;
+	}
+	sd->filetransfer_poll = b_timeout_add(interval * 1000,
+	                                      skype_filetransfer_poll, ic);
+}
+
+static void skype_filetransfer_progress(struct im_connection *ic, struct skype_filetransfer *ft)
+{
+	char *done, *size, *speed;
+
+	if (!ft->partner || !ft->active) {
+		return;
+	}
+	done = g_format_size(ft->bytes);
+	size = g_format_size(ft->size);
+	speed = g_format_size(ft->bps);
+	if (ft->bps && ft->size > ft->bytes) {
+		guint64 eta = (ft->size - ft->bytes) / ft->bps;
+		imcb_log(ic, "File transfer from user %s: %s of %s "
+		         "(%s/s, %d:%02d left).", ft->partner, done, size,
+		         speed, (int) (eta / 60), (int) (eta % 60));
+	} else {
+		imcb_log(ic, "File transfer from user %s: %s of %s (%s/s).",
+		         ft->partner, done, size, speed);
+	}
+	g_free(done);
+	g_free(size);
+	g_free(speed);
+}
+
+static gboolean skype_relay_write_request(file_transfer_t *file);
+
+static gboolean skype_relay_retry(gpointer data, gint fd,
+                                  b_input_condition cond)
+{
+	struct skype_relay *relay = data;
+
+	/* Unused parameters */
+	fd = fd;
+	cond = cond;
+
+	relay->retry = 0;
+	skype_relay_write_request(relay->ft);
+	return FALSE;
+}
+
+/* BitlBee asks for the next chunk once the previous one is on its way to
+ * the user, so we never read ahead more than a single chunk. */
+static gboolean skype_relay_write_request(file_transfer_t *file)
+{
+	struct skype_relay *relay = file->priv;
+	guint64 left = file->file_size - relay->offset;
+	ssize_t st;
+
+	st = read(relay->fd, relay->buf, MIN(left, sizeof(relay->buf)));
+	if (st < 0) {
+		imcb_file_canceled(relay->ic, file, "Error while reading file");
+		return FALSE;
+	}
+	if (st == 0) {
+		if (relay->complete) {
+			imcb_file_canceled(relay->ic, file, "File is truncated");
+			return FALSE;
+		}
+		/* Skype didn't write the next part yet, check again later. */
+		relay->retry = b_timeout_add(1000, skype_relay_retry, relay);
+		return TRUE;
+	}
+	relay->offset += st;
+	if (!file->write(file, relay->buf, st)) {
+		return FALSE;
+	}
+	if (relay->offset >= file->file_size) {
+		imcb_file_finished(relay->ic, file);
+	}
+	return TRUE;
+}
+
+static void skype_relay_free(file_transfer_t *file)
+{
+	struct skype_relay *relay = file->priv;
+	struct skype_data *sd = relay->ic->proto_data;
+	struct skype_filetransfer *ft;
+
+	if (relay->retry) {
+		b_event_remove(relay->retry);
+	}
+	close(relay->fd);
+
+	ft = g_hash_table_lookup(sd->filetransfers, relay->id);
+	if (ft && ft->relay == relay) {
+		ft->relay = NULL;
+	}
+	sd->relays = g_list_remove(sd->relays, relay);
+	g_free(relay->id);
+	g_free(relay);
+}
+
+static void skype_relay_start(struct im_connection *ic, struct skype_filetransfer *ft, int complete)
+{
+	struct skype_data *sd = ic->proto_data;
+	struct skype_relay *relay;
+	struct stat st;
+	char *name;
+	int fd;
+
+	if (ft->relay || ft->relay_failed || !ft->path ||
+	    !set_getbool(&ic->acc->set, "filetransfer_relay")) {
+		return;
+	}
+	fd = open(ft->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		imcb_error(ic, "Unable to relay %s: %s", ft->path,
+		           strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		ft->relay_failed = TRUE;
+		return;
+	}
+	if (!ft->size && complete) {
+		ft->size = st.st_size;
+	}
+	if (!ft->size) {
+		/* Try again once we know how much to send. */
+		close(fd);
+		return;
+	}
+
+	relay = g_new0(struct skype_relay, 1);
+	relay->ic = ic;
+	relay->id = g_strdup(ft->id);
+	relay->fd = fd;
+	relay->complete = complete;
+
+	name = g_path_get_basename(ft->path);
+	relay->ft = imcb_file_send_start(ic, ft->partner, name, ft->size);
+	g_free(name);
+	if (!relay->ft) {
+		/* Not a buddy, or BitlBee can't send files to the user. */
+		imcb_error(ic, "Unable to relay the file from user %s to you, "
+		           "it is saved to %s.", ft->partner, ft->path);
+		close(fd);
+		g_free(relay->id);
+		g_free(relay);
+		ft->relay_failed = TRUE;
+		return;
+	}
+	relay->ft->priv = relay;
+	relay->ft->write_request = skype_relay_write_request;
+	relay->ft->free = skype_relay_free;
+
+	ft->relay = relay;
+	sd->relays = g_list_append(sd->relays, relay);
+}
+
+/* Tell the user about a status of the transfer. Returns TRUE if the status
+ * is a terminal one. */
+static gboolean skype_filetransfer_report_status(struct im_connection *ic,
+                                                 struct skype_filetransfer *ft,
+                                                 int status)
+{
+	switch (status) {
+	case SKYPE_FILETRANSFER_NEW:
+		imcb_log(ic, "The user %s offered a new file for you.",
+		         ft->partner);
+		return FALSE;
+	case SKYPE_FILETRANSFER_FAILED:
+		imcb_log(ic, "Failed to transfer file from user %s.",
+		         ft->partner);
+		if (ft->relay) {
+			imcb_file_canceled(ic, ft->relay->ft,
+			                   "Skype file transfer failed");
+		}
+		break;
+	case SKYPE_FILETRANSFER_COMPLETED:
+		if (!ft->relay) {
+			skype_relay_start(ic, ft, TRUE);
+		}
+		if (ft->relay) {
+			/* The relay goes on on its own from now. */
+			ft->relay->complete = TRUE;
+			ft->relay = NULL;
+		}
+		if (ft->started && ft->size) {
+			time_t secs = MAX(time(NULL) - ft->started, 1);
+			char *size = g_format_size(ft->size);
+			char *speed = g_format_size(ft->size / secs);
+			imcb_log(ic, "File transfer from user %s completed "
+			         "(%s in %d seconds, %s/s).", ft->partner, size,
+			         (int) secs, speed);
+			g_free(size);
+			g_free(speed);
 		} else {
-			g_snprintf(buf, IRC_LINE_SIZE, "%s %s", set_getstr(&ic->acc->set, "edit_prefix"), body);
-			sd->is_edit = 0;
+			imcb_log(ic, "File transfer from user %s completed.",
+			         ft->partner);
+		}
+		break;
+	case SKYPE_FILETRANSFER_TRANSFERRING:
+		if (!ft->path) {
+			/* Already over, the path never came. */
+			return FALSE;
+		}
+		imcb_log(ic, "File transfer from user %s started, saving to %s.",
+		         ft->partner, ft->path);
+		skype_relay_start(ic, ft, FALSE);
+		return FALSE;
+	case SKYPE_FILETRANSFER_CANCELLED:
+		/* Don't be noisy, just forget about the transfer. */
+		if (ft->relay) {
+			imcb_file_canceled(ic, ft->relay->ft,
+			                   "Skype file transfer cancelled");
 		}
-	} else {
-		g_snprintf(buf, IRC_LINE_SIZE, "/me %s", body);
-	}
-	if (!gc) {
-		/* Private message */
-		imcb_buddy_msg(ic, sd->handle, buf, 0, 0);
-	} else {
-		/* Groupchat message */
-		imcb_chat_msg(gc, sd->handle, buf, 0, 0);
+		break;
+	default:
+		return FALSE;
 	}
+	return TRUE;
 }
 
-static void skype_parse_chatmessage(struct im_connection *ic, char *line)
+/* Tell the user about the pending statuses of the transfer, once we know
+ * who is on the other end. Returns TRUE if the transfer reached a terminal
+ * status, in which case the caller should forget about it. */
+static gboolean skype_filetransfer_report(struct im_connection *ic, struct skype_filetransfer *ft)
 {
-	struct skype_data *sd = ic->proto_data;
-	char *id = strchr(line, ' ');
-
-	if (!++id) {
-		return;
+	if (!ft->partner) {
+		return FALSE;
 	}
-	char *info = strchr(id, ' ');
+	while (ft->statuses) {
+		int status = GPOINTER_TO_INT(ft->statuses->data);
 
-	if (!info) {
-		return;
-	}
-	*info = '\0';
-	info++;
-	if (!strcmp(info, "STATUS RECEIVED") || !strncmp(info, "EDITED_TIMESTAMP", 16)) {
-		/* New message ID:
-		 * (1) Request its from field
-		 * (2) Request its body
-		 * (3) Request its type
-		 * (4) Query chatname
-		 */
-		skype_printf(ic, "GET CHATMESSAGE %s FROM_HANDLE\n", id);
-		if (!strcmp(info, "STATUS RECEIVED")) {
-			skype_printf(ic, "GET CHATMESSAGE %s BODY\n", id);
-		} else {
-			sd->is_edit = 1;
+		if (status == SKYPE_FILETRANSFER_TRANSFERRING && !ft->path &&
+		    !ft->statuses->next) {
+			/* Wait for the path, it's the interesting part. */
+			return FALSE;
 		}
-		skype_printf(ic, "GET CHATMESSAGE %s TYPE\n", id);
-		skype_printf(ic, "GET CHATMESSAGE %s CHATNAME\n", id);
-	} else if (!strncmp(info, "FROM_HANDLE ", 12)) {
-		info += 12;
-		/* New from field value. Store
-		 * it, then we can later use it
-		 * when we got the message's
-		 * body. */
-		g_free(sd->handle);
-		sd->handle = g_strdup_printf("%s", info);
-	} else if (!strncmp(info, "EDITED_BY ", 10)) {
-		info += 10;
-		/* This is the same as
-		 * FROM_HANDLE, except that we
-		 * never request these lines
-		 * from Skype, we just get
-		 * them. */
-		g_free(sd->handle);
-		sd->handle = g_strdup_printf("%s", info);
-	} else if (!strncmp(info, "BODY ", 5)) {
-		info += 5;
-		sd->body = g_list_append(sd->body, g_strdup(info));
-	} else if (!strncmp(info, "TYPE ", 5)) {
-		info += 5;
-		g_free(sd->type);
-		sd->type = g_strdup(info);
-	} else if (!strncmp(info, "CHATNAME ", 9)) {
-		info += 9;
-		if (sd->handle && sd->body && sd->type) {
-			struct groupchat *gc = skype_chat_get_or_create(ic, info);
-			int i;
-			for (i = 0; i < g_list_length(sd->body); i++) {
-				char *body = g_list_nth_data(sd->body, i);
-				if (!strcmp(sd->type, "SAID") ||
-				    !strcmp(sd->type, "EMOTED")) {
-					skype_parse_chatmessage_said_emoted(ic, gc, body);
-				} else if (!strcmp(sd->type, "SETTOPIC") && gc) {
-					imcb_chat_topic(gc,
-					                sd->handle, body, 0);
-				} else if (!strcmp(sd->type, "LEFT") && gc) {
-					imcb_chat_remove_buddy(gc,
-					                       sd->handle, NULL);
-				}
-			}
-			g_list_free(sd->body);
-			sd->body = NULL;
+		ft->statuses = g_list_delete_link(ft->statuses, ft->statuses);
+		if (skype_filetransfer_report_status(ic, ft, status)) {
+			return TRUE;
 		}
 	}
+	return FALSE;
 }
 
-static void skype_parse_call(struct im_connection *ic, char *line)
+static void skype_parse_filetransfer(struct im_connection *ic, char *line)
 {
 	struct skype_data *sd = ic->proto_data;
+	struct skype_filetransfer *ft;
 	char *id = strchr(line, ' ');
-	char buf[IRC_LINE_SIZE];
+	static const struct {
+		char *name;
+		int status;
+	} statuses[] = {
+		{ "NEW", SKYPE_FILETRANSFER_NEW },
+		{ "TRANSFERRING", SKYPE_FILETRANSFER_TRANSFERRING },
+		{ "COMPLETED", SKYPE_FILETRANSFER_COMPLETED },
+		{ "FAILED", SKYPE_FILETRANSFER_FAILED },
+		{ "CANCELLED", SKYPE_FILETRANSFER_CANCELLED },
+	};
 
 	if (!++id) {
 		return;
@@ -741,160 +1931,70 @@ static void skype_parse_call(struct im_connection *ic, char *line)
 	}
 	*info = '\0';
 	info++;
-	if (!strncmp(info, "FAILUREREASON ", 14)) {
-		sd->failurereason = atoi(strchr(info, ' '));
-	} else if (!strcmp(info, "STATUS RINGING")) {
-		if (sd->call_id) {
-			g_free(sd->call_id);
-		}
-		sd->call_id = g_strdup(id);
-		skype_printf(ic, "GET CALL %s PARTNER_HANDLE\n", id);
-		sd->call_status = SKYPE_CALL_RINGING;
-	} else if (!strcmp(info, "STATUS MISSED")) {
-		skype_printf(ic, "GET CALL %s PARTNER_HANDLE\n", id);
-		sd->call_status = SKYPE_CALL_MISSED;
-	} else if (!strcmp(info, "STATUS CANCELLED")) {
-		skype_printf(ic, "GET CALL %s PARTNER_HANDLE\n", id);
-		sd->call_status = SKYPE_CALL_CANCELLED;
-	} else if (!strcmp(info, "STATUS FINISHED")) {
-		skype_printf(ic, "GET CALL %s PARTNER_HANDLE\n", id);
-		sd->call_status = SKYPE_CALL_FINISHED;
-	} else if (!strcmp(info, "STATUS REFUSED")) {
-		skype_printf(ic, "GET CALL %s PARTNER_HANDLE\n", id);
-		sd->call_status = SKYPE_CALL_REFUSED;
-	} else if (!strcmp(info, "STATUS UNPLACED")) {
-		if (sd->call_id) {
-			g_free(sd->call_id);
-		}
-		/* Save the ID for later usage (Cancel/Finish). */
-		sd->call_id = g_strdup(id);
-		sd->call_out = TRUE;
-	} else if (!strcmp(info, "STATUS FAILED")) {
-		imcb_error(ic, "Call failed: %s",
-		           skype_call_strerror(sd->failurereason));
-		sd->call_id = NULL;
-	} else if (!strncmp(info, "DURATION ", 9)) {
-		if (sd->call_duration) {
-			g_free(sd->call_duration);
+	if (!strncmp(info, "STATUS ", 7)) {
+		int i, status = SKYPE_FILETRANSFER_OTHER;
+		GList *last;
+
+		info += 7;
+		ft = skype_filetransfer_get_or_create(ic, id);
+		for (i = 0; i < ARRAY_SIZE(statuses); i++) {
+			if (!strcmp(info, statuses[i].name)) {
+				status = statuses[i].status;
+				break;
+			}
 		}
-		sd->call_duration = g_strdup(info + 9);
-	} else if (!strncmp(info, "PARTNER_HANDLE ", 15)) {
-		info += 15;
-		if (!sd->call_status) {
-			return;
+		last = g_list_last(ft->statuses);
+		if (!last || GPOINTER_TO_INT(last->data) != status) {
+			ft->statuses = g_list_append(ft->statuses,
+			                             GINT_TO_POINTER(status));
 		}
-		switch (sd->call_status) {
-		case SKYPE_CALL_RINGING:
-			if (sd->call_out) {
-				imcb_log(ic, "You are currently ringing the user %s.", info);
-			} else {
-				g_snprintf(buf, IRC_LINE_SIZE,
-				           "The user %s is currently ringing you.",
-				           info);
-				skype_call_ask(ic, sd->call_id, buf);
-			}
-			break;
-		case SKYPE_CALL_MISSED:
-			imcb_log(ic, "You have missed a call from user %s.",
-			         info);
-			break;
-		case SKYPE_CALL_CANCELLED:
-			imcb_log(ic, "You cancelled the call to the user %s.",
-			         info);
-			sd->call_status = 0;
-			sd->call_out = FALSE;
-			break;
-		case SKYPE_CALL_REFUSED:
-			if (sd->call_out) {
-				imcb_log(ic, "The user %s refused the call.",
-				         info);
-			} else {
-				imcb_log(ic,
-				         "You refused the call from user %s.",
-				         info);
+		ft->active = status == SKYPE_FILETRANSFER_TRANSFERRING;
+		if (ft->active) {
+			if (!ft->started) {
+				ft->started = time(NULL);
 			}
-			sd->call_out = FALSE;
-			break;
-		case SKYPE_CALL_FINISHED:
-			if (sd->call_duration) {
-				imcb_log(ic,
-				         "You finished the call to the user %s "
-				         "(duration: %s seconds).",
-				         info, sd->call_duration);
-			} else {
-				imcb_log(ic,
-				         "You finished the call to the user %s.",
-				         info);
+			if (!ft->path) {
+				skype_printf(ic, "GET FILETRANSFER %s FILEPATH\n", id);
 			}
-			sd->call_out = FALSE;
-			break;
-		default:
-			/* Don't be noisy, ignore other statuses for now. */
-			break;
+			skype_filetransfer_poll_start(ic);
+		}
+		if (skype_filetransfer_report(ic, ft)) {
+			g_hash_table_remove(sd->filetransfers, id);
 		}
-		sd->call_status = 0;
-	}
-}
-
-static void skype_parse_filetransfer(struct im_connection *ic, char *line)
-{
-	struct skype_data *sd = ic->proto_data;
-	char *id = strchr(line, ' ');
-
-	if (!++id) {
 		return;
 	}
-	char *info = strchr(id, ' ');
 
-	if (!info) {
+	ft = g_hash_table_lookup(sd->filetransfers, id);
+	if (!ft) {
 		return;
 	}
-	*info = '\0';
-	info++;
-	if (!strcmp(info, "STATUS NEW")) {
-		skype_printf(ic, "GET FILETRANSFER %s PARTNER_HANDLE\n",
-		             id);
-		sd->filetransfer_status = SKYPE_FILETRANSFER_NEW;
-	} else if (!strcmp(info, "STATUS FAILED")) {
-		skype_printf(ic, "GET FILETRANSFER %s PARTNER_HANDLE\n",
-		             id);
-		sd->filetransfer_status = SKYPE_FILETRANSFER_FAILED;
-	} else if (!strcmp(info, "STATUS COMPLETED")) {
-		skype_printf(ic, "GET FILETRANSFER %s PARTNER_HANDLE\n", id);
-		sd->filetransfer_status = SKYPE_FILETRANSFER_COMPLETED;
-	} else if (!strcmp(info, "STATUS TRANSFERRING")) {
-		skype_printf(ic, "GET FILETRANSFER %s PARTNER_HANDLE\n", id);
-		sd->filetransfer_status = SKYPE_FILETRANSFER_TRANSFERRING;
-	} else if (!strncmp(info, "FILEPATH ", 9)) {
+	if (!strncmp(info, "FILEPATH ", 9)) {
 		info += 9;
-		sd->filetransfer_path = g_strdup(info);
-	} else if (!strncmp(info, "PARTNER_HANDLE ", 15)) {
-		info += 15;
-		if (!sd->filetransfer_status) {
+		if (!*info) {
+			/* Not accepted yet. */
 			return;
 		}
-		switch (sd->filetransfer_status) {
-		case SKYPE_FILETRANSFER_NEW:
-			imcb_log(ic, "The user %s offered a new file for you.",
-			         info);
-			break;
-		case SKYPE_FILETRANSFER_FAILED:
-			imcb_log(ic, "Failed to transfer file from user %s.",
-			         info);
-			break;
-		case SKYPE_FILETRANSFER_COMPLETED:
-			imcb_log(ic, "File transfer from user %s completed.", info);
-			break;
-		case SKYPE_FILETRANSFER_TRANSFERRING:
-			if (sd->filetransfer_path) {
-				imcb_log(ic, "File transfer from user %s started, saving to %s.", info,
-				         sd->filetransfer_path);
-				g_free(sd->filetransfer_path);
-				sd->filetransfer_path = NULL;
-			}
-			break;
-		}
-		sd->filetransfer_status = 0;
+		g_free(ft->path);
+		ft->path = g_strdup(info);
+	} else if (!strncmp(info, "PARTNER_HANDLE ", 15)) {
+		info += 15;
+		g_free(ft->partner);
+		ft->partner = g_strdup(info);
+	} else if (!strncmp(info, "FILESIZE ", 9)) {
+		ft->size = g_ascii_strtoull(info + 9, NULL, 10);
+		return;
+	} else if (!strncmp(info, "BYTESTRANSFERRED ", 17)) {
+		ft->bytes = g_ascii_strtoull(info + 17, NULL, 10);
+		return;
+	} else if (!strncmp(info, "BYTESPERSECOND ", 15)) {
+		ft->bps = g_ascii_strtoull(info + 15, NULL, 10);
+		skype_filetransfer_progress(ic, ft);
+		return;
+	} else {
+		return;
+	}
+	if (skype_filetransfer_report(ic, ft)) {
+		g_hash_table_remove(sd->filetransfers, id);
 	}
 }
 
@@ -1115,13 +2215,96 @@ static void skype_parse_chat(struct im_connection *ic, char *line)
 	}
 }
 
+static gboolean skype_heartbeat(gpointer data, gint fd,
+                                b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+
+	/* Unused parameters */
+	fd = fd;
+	cond = cond;
+
+	if (sd->ping_sent) {
+		/* Still unanswered. Don't send another one, its PONG would be
+		 * timed against the newer PING. */
+		if (sd->pong_seen &&
+		    ++sd->ping_misses >= set_getint(&ic->acc->set, "heartbeat_misses")) {
+			imcb_error(ic, "skyped did not answer for %d heartbeats",
+			           sd->ping_misses);
+			sd->heartbeat_id = 0;
+			skype_link_lost(ic);
+			return FALSE;
+		}
+		return TRUE;
+	}
+	sd->ping_sent = g_get_monotonic_time();
+	skype_printf(ic, "PING\n");
+	return TRUE;
+}
+
+static void skype_heartbeat_start(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	int interval = set_getint(&ic->acc->set, "heartbeat");
+
+	sd->ping_sent = 0;
+	sd->ping_misses = 0;
+	sd->pong_seen = FALSE;
+	sd->rtt = 0;
+	sd->rtt_max = 0;
+	if (interval > 0) {
+		sd->heartbeat_id = b_timeout_add(interval * 1000,
+		                                 skype_heartbeat, ic);
+	}
+}
+
+static void skype_heartbeat_stop(struct skype_data *sd)
+{
+	if (sd->heartbeat_id) {
+		b_event_remove(sd->heartbeat_id);
+		sd->heartbeat_id = 0;
+	}
+}
+
+static void skype_parse_pong(struct im_connection *ic, char *line)
+{
+	struct skype_data *sd = ic->proto_data;
+	double rtt;
+
+	/* Unused parameter */
+	line = line;
+
+	if (!sd->ping_sent) {
+		return;
+	}
+	rtt = (g_get_monotonic_time() - sd->ping_sent) / 1000.0;
+	/* Exponentially weighted, so a single slow reply stands out in
+	 * rtt_max but doesn't dominate the average. */
+	sd->rtt = sd->pong_seen ? sd->rtt * 0.875 + rtt * 0.125 : rtt;
+	if (rtt > sd->rtt_max) {
+		sd->rtt_max = rtt;
+	}
+	sd->ping_sent = 0;
+	sd->ping_misses = 0;
+	sd->pong_seen = TRUE;
+}
+
 static void skype_parse_password(struct im_connection *ic, char *line)
 {
+	struct skype_data *sd = ic->proto_data;
+
 	if (!strncmp(line + 9, "OK", 2)) {
-		imcb_connected(ic);
+		sd->reconnect_attempts = 0;
+		skype_heartbeat_start(ic);
+		if (ic->flags & OPT_LOGGED_IN) {
+			imcb_log(ic, "Reconnected to skyped");
+		} else {
+			imcb_connected(ic);
+		}
 	} else {
 		imcb_error(ic, "Authentication Failed");
-		imc_logout(ic, TRUE);
+		skype_logout_later(ic);
 	}
 }
 
@@ -1153,6 +2336,8 @@ static void skype_parse_chats(struct im_connection *ic, char *line)
 
 static void skype_parse_groups(struct im_connection *ic, char *line)
 {
+	struct skype_data *sd = ic->proto_data;
+
 	if (!set_getbool(&ic->acc->set, "read_groups")) {
 		return;
 	}
@@ -1162,55 +2347,231 @@ static void skype_parse_groups(struct im_connection *ic, char *line)
 
 	i = groups;
 	while (*i) {
-		skype_printf(ic, "GET GROUP %s DISPLAYNAME\n", *i);
+		if (!sd->resync || !skype_group_by_id(ic, atoi(*i))) {
+			skype_printf(ic, "GET GROUP %s DISPLAYNAME\n", *i);
+		}
 		skype_printf(ic, "GET GROUP %s USERS\n", *i);
 		i++;
 	}
-	g_strfreev(groups);
+	g_strfreev(groups);
+}
+
+static void skype_parse_alter_group(struct im_connection *ic, char *line)
+{
+	char *id = line + strlen("ALTER GROUP");
+
+	if (!++id) {
+		return;
+	}
+
+	char *info = strchr(id, ' ');
+
+	if (!info) {
+		return;
+	}
+	*info = '\0';
+	info++;
+
+	if (!strncmp(info, "ADDUSER ", 8)) {
+		struct skype_group *sg = skype_group_by_id(ic, atoi(id));
+
+		info += 8;
+		if (sg) {
+			char *buf = g_strdup_printf("%s", info);
+			sg->users = g_list_append(sg->users, g_strdup(info));
+			imcb_add_buddy(ic, buf, sg->name);
+			g_free(buf);
+		} else {
+			log_message(LOGLVL_ERROR,
+			            "No skype group with id %s. That's probably a bug.", id);
+		}
+	}
+}
+
+/* Let the commands held back while negotiating go. */
+static void skype_negotiate_release(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	GQueue *held = sd->held;
+	char *cmd;
+
+	sd->held = NULL;
+	if (held) {
+		while ((cmd = g_queue_pop_head(held))) {
+			skype_write_now(ic, cmd, strlen(cmd));
+			g_free(cmd);
+		}
+		g_queue_free(held);
+	}
+	skype_pump(ic);
+}
+
+static gboolean skype_negotiate_timeout(gpointer data, gint fd,
+                                        b_input_condition cond);
+
+/* Ask skyped for the next link feature we want. One at a time, as each of
+ * them changes how the rest of the stream looks. */
+static void skype_negotiate(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	char *req;
+
+	if (sd->negotiate_timeout) {
+		b_event_remove(sd->negotiate_timeout);
+		sd->negotiate_timeout = 0;
+	}
+	while (++sd->negotiate < SKYPE_NEGOTIATE_DONE) {
+		req = NULL;
+		if (sd->negotiate == SKYPE_NEGOTIATE_COMPRESS &&
+		    set_getbool(&ic->acc->set, "compression")) {
+			req = "COMPRESS DEFLATE\n";
+		} else if (sd->negotiate == SKYPE_NEGOTIATE_FRAMING &&
+		           set_getbool(&ic->acc->set, "framing")) {
+			req = "FRAMING V2\n";
+		}
+		if (req) {
+			if (!sd->held) {
+				sd->held = g_queue_new();
+			}
+			sd->negotiate_timeout = b_timeout_add(SKYPE_NEGOTIATE_TIMEOUT,
+			                                      skype_negotiate_timeout, ic);
+			skype_send(ic, req, strlen(req));
+			return;
+		}
+	}
+	skype_negotiate_release(ic);
+}
+
+static void skype_negotiate_refused(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+
+	imcb_log(ic, "skyped does not support %s, going on without it",
+	         sd->negotiate == SKYPE_NEGOTIATE_COMPRESS ?
+	         "compression" : "protocol v2");
+	skype_negotiate(ic);
+}
+
+static gboolean skype_negotiate_timeout(gpointer data, gint fd,
+                                        b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+
+	/* Unused parameters */
+	fd = fd;
+	cond = cond;
+
+	sd->negotiate_timeout = 0;
+	skype_negotiate_refused(ic);
+	return FALSE;
+}
+
+/* A reply to a link feature we are not waiting for anymore: we already
+ * went on without it, so the two sides disagree about the stream. */
+static gboolean skype_negotiate_late(struct im_connection *ic, int feature)
+{
+	struct skype_data *sd = ic->proto_data;
+
+	if (sd->negotiate == feature) {
+		return FALSE;
+	}
+	imcb_error(ic, "Late negotiation reply from skyped");
+	skype_link_lost(ic);
+	return TRUE;
+}
+
+static void skype_compress_end(struct skype_data *sd)
+{
+	if (sd->compress) {
+		inflateEnd(&sd->zin);
+		deflateEnd(&sd->zout);
+	}
+	sd->compress = FALSE;
+	sd->compress_start = FALSE;
+	sd->framing = FALSE;
+	sd->negotiate = 0;
+	if (sd->negotiate_timeout) {
+		b_event_remove(sd->negotiate_timeout);
+		sd->negotiate_timeout = 0;
+	}
+	if (sd->held) {
+		g_queue_free_full(sd->held, g_free);
+		sd->held = NULL;
+	}
 }
 
-static void skype_parse_alter_group(struct im_connection *ic, char *line)
+static void skype_parse_compress(struct im_connection *ic, char *line)
 {
-	char *id = line + strlen("ALTER GROUP");
+	struct skype_data *sd = ic->proto_data;
 
-	if (!++id) {
+	if (strcmp(line + 9, "OK")) {
+		if (sd->negotiate == SKYPE_NEGOTIATE_COMPRESS) {
+			skype_negotiate(ic);
+		}
 		return;
 	}
+	if (skype_negotiate_late(ic, SKYPE_NEGOTIATE_COMPRESS)) {
+		return;
+	}
+	memset(&sd->zin, 0, sizeof(sd->zin));
+	memset(&sd->zout, 0, sizeof(sd->zout));
+	if (inflateInit(&sd->zin) != Z_OK) {
+		imcb_error(ic, "Unable to set up compression");
+		skype_link_lost(ic);
+		return;
+	}
+	if (deflateInit(&sd->zout, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		inflateEnd(&sd->zin);
+		imcb_error(ic, "Unable to set up compression");
+		skype_link_lost(ic);
+		return;
+	}
+	sd->compress = TRUE;
+	sd->compress_start = TRUE;
+	skype_negotiate(ic);
+}
 
-	char *info = strchr(id, ' ');
+/* "FRAMING OK": from now on both directions are framed, see
+ * SKYPE_FRAME_HEADER. Anything else means skyped stays with lines. Not
+ * called PROTOCOL, since an old skyped would pass that on to Skype. */
+static void skype_parse_framing(struct im_connection *ic, char *line)
+{
+	struct skype_data *sd = ic->proto_data;
 
-	if (!info) {
+	if (strcmp(line + 8, "OK")) {
+		if (sd->negotiate == SKYPE_NEGOTIATE_FRAMING) {
+			skype_negotiate(ic);
+		}
 		return;
 	}
-	*info = '\0';
-	info++;
+	if (skype_negotiate_late(ic, SKYPE_NEGOTIATE_FRAMING)) {
+		return;
+	}
+	sd->framing = TRUE;
+	skype_negotiate(ic);
+}
 
-	if (!strncmp(info, "ADDUSER ", 8)) {
-		struct skype_group *sg = skype_group_by_id(ic, atoi(id));
+/* An older skyped passes our negotiation requests on to Skype, which
+ * doesn't know them. Nothing else is sent meanwhile (see skype_write_now()),
+ * so an error then is the answer, no need to wait for the timeout. */
+static void skype_parse_error(struct im_connection *ic, char *line)
+{
+	struct skype_data *sd = ic->proto_data;
 
-		info += 8;
-		if (sg) {
-			char *buf = g_strdup_printf("%s", info);
-			sg->users = g_list_append(sg->users, g_strdup(info));
-			imcb_add_buddy(ic, buf, sg->name);
-			g_free(buf);
-		} else {
-			log_message(LOGLVL_ERROR,
-			            "No skype group with id %s. That's probably a bug.", id);
-		}
+	/* Unused parameter */
+	line = line;
+
+	if (sd->negotiate_timeout) {
+		skype_negotiate_refused(ic);
 	}
 }
 
 typedef void (*skype_parser)(struct im_connection *ic, char *line);
 
-static gboolean skype_read_callback(gpointer data, gint fd,
-                                    b_input_condition cond)
+static void skype_parse_line(struct im_connection *ic, char *line)
 {
-	struct im_connection *ic = data;
-	struct skype_data *sd = ic->proto_data;
-	char buf[IRC_LINE_SIZE];
-	int st, i;
-	char **lines, **lineptr, *line;
+	int i;
 	static struct parse_map {
 		char *k;
 		skype_parser v;
@@ -1225,11 +2586,131 @@ static gboolean skype_read_callback(gpointer data, gint fd,
 		{ "PASSWORD ", skype_parse_password },
 		{ "PROFILE PSTN_BALANCE ", skype_parse_profile },
 		{ "PING", skype_parse_ping },
+		{ "PONG", skype_parse_pong },
 		{ "CHATS ", skype_parse_chats },
 		{ "GROUPS ", skype_parse_groups },
 		{ "ALTER GROUP ", skype_parse_alter_group },
+		{ "COMPRESS ", skype_parse_compress },
+		{ "FRAMING ", skype_parse_framing },
+		{ "ERROR ", skype_parse_error },
 	};
 
+	if (set_getbool(&ic->acc->set, "skypeconsole_receive")) {
+		imcb_buddy_msg(ic, "skypeconsole", line, 0, 0);
+	}
+	for (i = 0; i < ARRAY_SIZE(parsers); i++) {
+		if (!strncmp(line, parsers[i].k,
+		             strlen(parsers[i].k))) {
+			parsers[i].v(ic, line);
+			break;
+		}
+	}
+}
+
+static gboolean skype_inflate(struct im_connection *ic, char *buf, int len)
+{
+	struct skype_data *sd = ic->proto_data;
+	char out[IRC_LINE_SIZE];
+	int st;
+
+	sd->zin.next_in = (Bytef *) buf;
+	sd->zin.avail_in = len;
+	do {
+		sd->zin.next_out = (Bytef *) out;
+		sd->zin.avail_out = sizeof(out);
+		st = inflate(&sd->zin, Z_SYNC_FLUSH);
+		if (st != Z_OK && st != Z_BUF_ERROR) {
+			imcb_error(ic, "Corrupted compressed data from skyped");
+			return FALSE;
+		}
+		g_string_append_len(sd->rbuf, out,
+		                    sizeof(out) - sd->zin.avail_out);
+	} while (sd->zin.avail_out == 0);
+
+	return TRUE;
+}
+
+/* Hand out every whole line or frame of the receive buffer, keeping the
+ * rest. */
+static gboolean skype_parse_lines(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	char *line, *nl, saved;
+	guint32 hdr[2];
+	gsize len, pos = 0;
+
+	for (;;) {
+		if (sd->framing) {
+			if (sd->rbuf->len - pos < SKYPE_FRAME_HEADER) {
+				break;
+			}
+			memcpy(hdr, sd->rbuf->str + pos, sizeof(hdr));
+			len = ntohl(hdr[0]);
+			if (len > SKYPE_FRAME_MAX) {
+				imcb_error(ic, "Corrupted frame from skyped");
+				return FALSE;
+			}
+			if (sd->rbuf->len - pos - SKYPE_FRAME_HEADER < len) {
+				break;
+			}
+			sd->reply_id = ntohl(hdr[1]);
+			line = sd->rbuf->str + pos + SKYPE_FRAME_HEADER;
+			pos += SKYPE_FRAME_HEADER + len;
+			sd->rx_bytes += SKYPE_FRAME_HEADER + len;
+		} else {
+			nl = memchr(sd->rbuf->str + pos, '\n',
+			            sd->rbuf->len - pos);
+			if (!nl) {
+				break;
+			}
+			sd->reply_id = 0;
+			line = sd->rbuf->str + pos;
+			len = nl - line;
+			pos += len + 1;
+			sd->rx_bytes += len + 1;
+		}
+		/* Either the newline or the start of the next frame. The
+		 * parsers only touch the line itself. */
+		saved = line[len];
+		line[len] = '\0';
+		if (*line && !skype_request_reply(ic, line)) {
+			skype_parse_line(ic, line);
+		}
+		if (sd->fd < 0) {
+			/* The link went away, rbuf is gone too. */
+			return FALSE;
+		}
+		line[len] = saved;
+		if (sd->compress_start) {
+			/* Everything after "COMPRESS OK" is deflated. */
+			GString *rest = g_string_new_len(sd->rbuf->str + pos,
+			                                 sd->rbuf->len - pos);
+
+			sd->compress_start = FALSE;
+			g_string_truncate(sd->rbuf, 0);
+			pos = 0;
+			if (!skype_inflate(ic, rest->str, rest->len)) {
+				g_string_free(rest, TRUE);
+				return FALSE;
+			}
+			g_string_free(rest, TRUE);
+		}
+	}
+	g_string_erase(sd->rbuf, 0, pos);
+	sd->reply_id = 0;
+	skype_pump(ic);
+
+	return TRUE;
+}
+
+static gboolean skype_read_callback(gpointer data, gint fd,
+                                    b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+	char buf[IRC_LINE_SIZE];
+	int st;
+
 	/* Unused parameters */
 	fd = fd;
 	cond = cond;
@@ -1238,48 +2719,66 @@ static gboolean skype_read_callback(gpointer data, gint fd,
 		return FALSE;
 	}
 	/* Read the whole data. */
-	st = ssl_read(sd->ssl, buf, sizeof(buf));
-	if (st >= IRC_LINE_SIZE - 1) {
-		/* As we don't buffer incoming data, if IRC_LINE_SIZE amount of bytes
-		 * were received, there's a good chance last message was truncated
-		 * and the next recv() will yield garbage. */
-		imcb_error(ic, "Unable to handle incoming data from skyped");
-		st = 0;
-	}
+	st = skype_sock_read(sd, buf, sizeof(buf));
 	if (st > 0) {
-		buf[st] = '\0';
-		/* Then split it up to lines. */
-		lines = g_strsplit(buf, "\n", 0);
-		lineptr = lines;
-		while ((line = *lineptr)) {
-			if (!strlen(line)) {
-				break;
-			}
-			if (set_getbool(&ic->acc->set, "skypeconsole_receive")) {
-				imcb_buddy_msg(ic, "skypeconsole", line, 0, 0);
+		sd->rx_wire += st;
+		if (sd->compress && !sd->compress_start) {
+			if (!skype_inflate(ic, buf, st)) {
+				skype_link_lost(ic);
+				return FALSE;
 			}
-			for (i = 0; i < ARRAY_SIZE(parsers); i++) {
-				if (!strncmp(line, parsers[i].k,
-				             strlen(parsers[i].k))) {
-					parsers[i].v(ic, line);
-					break;
-				}
+		} else {
+			g_string_append_len(sd->rbuf, buf, st);
+		}
+		/* Then split it up to lines. */
+		if (!skype_parse_lines(ic)) {
+			if (sd->fd >= 0) {
+				skype_link_lost(ic);
 			}
-			lineptr++;
+			return FALSE;
 		}
-		g_strfreev(lines);
-	} else if (st == 0 || (st < 0 && !ssl_sockerr_again(sd->ssl))) {
-		ssl_disconnect(sd->ssl);
-		sd->fd = -1;
-		sd->ssl = NULL;
-
+	} else if (st == 0 || (st < 0 && !skype_sock_again(sd))) {
 		imcb_error(ic, "Error while reading from server");
-		imc_logout(ic, TRUE);
+		skype_link_lost(ic);
 		return FALSE;
 	}
 	return TRUE;
 }
 
+/* Fetch whatever may have changed while we were away, keeping the roster,
+ * groups and chats we already have. */
+static void skype_resync(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	GHashTableIter iter;
+	gpointer key;
+	GSList *l;
+
+	/* We'll never get the replies of the lost link, so drop the info
+	 * commands and what's left of their queries. */
+	g_hash_table_iter_init(&iter, sd->info_requests);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		skype_cancel(ic, "INFO", key);
+	}
+	g_hash_table_remove_all(sd->info_requests);
+
+	if (set_getbool(&ic->acc->set, "read_groups")) {
+		skype_printf(ic, "SEARCH GROUPS CUSTOM\n");
+	}
+	skype_printf(ic, "SEARCH FRIENDS\n");
+	skype_printf(ic, "SET USERSTATUS %s\n", sd->status);
+
+	for (l = ic->groupchats; l; l = l->next) {
+		struct groupchat *gc = l->data;
+
+		/* Not the fake one from skype_chat_with(), nor a parted one. */
+		if (*gc->title && !gc->data) {
+			skype_printf(ic, "GET CHAT %s ACTIVEMEMBERS\n",
+			             gc->title);
+		}
+	}
+}
+
 gboolean skype_start_stream(struct im_connection *ic)
 {
 	struct skype_data *sd = ic->proto_data;
@@ -1295,11 +2794,27 @@ gboolean skype_start_stream(struct im_connection *ic)
 	}
 
 	/* Log in */
-	skype_printf(ic, "USERNAME %s\n", ic->acc->user);
+	st = skype_printf(ic, "USERNAME %s\n", ic->acc->user);
 	skype_printf(ic, "PASSWORD %s\n", ic->acc->pass);
 
+	/* Ask for compression and framing, holding back everything else
+	 * until skyped answers. */
+	skype_negotiate(ic);
+
+	if (sd->resync) {
+		char *cmd;
+
+		skype_resync(ic);
+		/* What the user did meanwhile, after our state is restored. */
+		while ((cmd = g_queue_pop_head(sd->interactive))) {
+			skype_write_now(ic, cmd, strlen(cmd));
+			g_free(cmd);
+		}
+		return st;
+	}
+
 	/* This will download all buddies and groups. */
-	st = skype_printf(ic, "SEARCH GROUPS CUSTOM\n");
+	skype_printf(ic, "SEARCH GROUPS CUSTOM\n");
 	skype_printf(ic, "SEARCH FRIENDS\n");
 
 	skype_printf(ic, "SET USERSTATUS ONLINE\n");
@@ -1315,6 +2830,9 @@ gboolean skype_start_stream(struct im_connection *ic)
 	return st;
 }
 
+static void skype_connect(struct im_connection *ic);
+static void skype_connect_failed(struct im_connection *ic);
+
 gboolean skype_connected(gpointer data, int returncode, void *source, b_input_condition cond)
 {
 	struct im_connection *ic = data;
@@ -1325,26 +2843,197 @@ gboolean skype_connected(gpointer data, int returncode, void *source, b_input_co
 
 	if (!source) {
 		sd->ssl = NULL;
+		sd->fd = -1;
 		imcb_error(ic, "Could not connect to server");
-		imc_logout(ic, TRUE);
+		skype_connect_failed(ic);
 		return FALSE;
 	}
+	/* Only now, writing during the handshake would fail. */
+	sd->ssl = source;
+	sd->fd = ssl_getfd(sd->ssl);
 	imcb_log(ic, "Connected to server, logging in");
 
 	return skype_start_stream(ic);
 }
 
+static void skype_disconnect(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+
+	if (sd->bfd > 0) {
+		b_event_remove(sd->bfd);
+		sd->bfd = 0;
+	}
+	if (sd->ssl) {
+		ssl_disconnect(sd->ssl);
+		sd->ssl = NULL;
+	} else if (sd->fd >= 0) {
+		close(sd->fd);
+	}
+	sd->fd = -1;
+	g_string_truncate(sd->rbuf, 0);
+	skype_compress_end(sd);
+	skype_heartbeat_stop(sd);
+	skype_request_lost(sd);
+}
+
+static gboolean skype_reconnect(gpointer data, gint fd,
+                                b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+
+	/* Unused parameters */
+	fd = fd;
+	cond = cond;
+
+	sd->reconnect_id = 0;
+	imcb_log(ic, "Reconnecting");
+	skype_connect(ic);
+	return FALSE;
+}
+
+static gboolean skype_give_up(gpointer data, gint fd,
+                              b_input_condition cond)
+{
+	struct im_connection *ic = data;
+	struct skype_data *sd = ic->proto_data;
+
+	/* Unused parameters */
+	fd = fd;
+	cond = cond;
+
+	sd->reconnect_id = 0;
+	imc_logout(ic, TRUE);
+	return FALSE;
+}
+
+/* Log out, but not right here: our callers (a parser, say) may still use
+ * sd. Disconnecting stops the parsing. */
+static void skype_logout_later(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+
+	skype_disconnect(ic);
+	if (sd->reconnect_id) {
+		b_event_remove(sd->reconnect_id);
+	}
+	sd->reconnect_id = b_timeout_add(0, skype_give_up, ic);
+}
+
+/* The link to skyped is gone. Instead of logging out, which would throw away
+ * the roster and every chat, try to get it back in the background. */
+static void skype_link_lost(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	int delay;
+
+	skype_disconnect(ic);
+
+	if (sd->reconnect_id) {
+		return;
+	}
+	if (!(ic->flags & OPT_LOGGED_IN) ||
+	    !set_getbool(&ic->acc->set, "reconnect") ||
+	    sd->reconnect_attempts >= set_getint(&ic->acc->set,
+	                                         "reconnect_attempts")) {
+		skype_logout_later(ic);
+		return;
+	}
+
+	/* Exponential backoff with jitter, so that several accounts don't
+	 * hammer a restarted skyped at the same time. */
+	delay = MIN(1 << MIN(sd->reconnect_attempts, 16),
+	            SKYPE_RECONNECT_MAX_DELAY);
+	delay = delay * 500 + g_random_int_range(0, delay * 500 + 1);
+	sd->reconnect_attempts++;
+	sd->resync = TRUE;
+
+	imcb_log(ic, "Lost connection to skyped, reconnecting in %d seconds",
+	         (delay + 500) / 1000);
+	sd->reconnect_id = b_timeout_add(delay, skype_reconnect, ic);
+}
+
+static void skype_connect_failed(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+
+	if (sd->resync) {
+		skype_link_lost(ic);
+	} else {
+		imc_logout(ic, TRUE);
+	}
+}
+
+/* skyped on the same host: no need for TLS, the socket's permissions keep
+ * others out. */
+static void skype_connect_unix(struct im_connection *ic, const char *path)
+{
+	struct skype_data *sd = ic->proto_data;
+	struct sockaddr_un sa;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	g_strlcpy(sa.sun_path, path, sizeof(sa.sun_path));
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		imcb_error(ic, "Could not connect to %s: %s", path,
+		           strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		skype_connect_failed(ic);
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	sd->fd = fd;
+
+	imcb_log(ic, "Connected to server, logging in");
+	skype_start_stream(ic);
+}
+
+static void skype_connect(struct im_connection *ic)
+{
+	struct skype_data *sd = ic->proto_data;
+	account_t *acc = ic->acc;
+	char *server = set_getstr(&acc->set, "server");
+
+	if (g_str_has_prefix(server, "unix:")) {
+		skype_connect_unix(ic, server + 5);
+		return;
+	}
+	/* BitlBee caches TLS sessions by hostname, so reconnecting to the same
+	 * server only costs an abbreviated handshake. */
+	sd->ssl = ssl_connect(server, set_getint(&acc->set, "port"), FALSE,
+	                      skype_connected, ic);
+	if (!sd->ssl && sd->resync) {
+		skype_link_lost(ic);
+	}
+}
+
 static void skype_login(account_t *acc)
 {
 	struct im_connection *ic = imcb_new(acc);
 	struct skype_data *sd = g_new0(struct skype_data, 1);
 
 	ic->proto_data = sd;
-
-	imcb_log(ic, "Connecting");
-	sd->ssl = ssl_connect(set_getstr(&acc->set, "server"),
-	                      set_getint(&acc->set, "port"), FALSE, skype_connected, ic);
-	sd->fd = sd->ssl ? ssl_getfd(sd->ssl) : -1;
+	sd->calls = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+	                                  skype_call_free);
+	sd->filetransfers = g_hash_table_new_full(g_str_hash, g_str_equal,
+	                                          NULL, skype_filetransfer_free);
+	sd->info_requests = g_hash_table_new_full(g_str_hash, g_str_equal,
+	                                          NULL, skype_info_request_free);
+	sd->info_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+	                                       g_free, skype_info_cached_free);
+	sd->status = "ONLINE";
+	sd->fd = -1;
+	sd->rbuf = g_string_new("");
+	sd->bulk = g_queue_new();
+	sd->interactive = g_queue_new();
+	sd->pending = g_hash_table_new(g_str_hash, g_str_equal);
 	sd->username = g_strdup(acc->user);
 	imcb_selfname(ic, sd->username);
 
@@ -1355,6 +3044,10 @@ static void skype_login(account_t *acc)
 	if (set_getbool(&acc->set, "skypeconsole")) {
 		imcb_add_buddy(ic, "skypeconsole", NULL);
 	}
+
+	/* Last, connecting over a unix socket may log us out right away. */
+	imcb_log(ic, "Connecting");
+	skype_connect(ic);
 }
 
 static void skype_logout(struct im_connection *ic)
@@ -1362,7 +3055,13 @@ static void skype_logout(struct im_connection *ic)
 	struct skype_data *sd = ic->proto_data;
 	int i;
 
-	skype_printf(ic, "SET USERSTATUS OFFLINE\n");
+	if (sd->fd >= 0) {
+		skype_printf(ic, "SET USERSTATUS OFFLINE\n");
+	}
+	if (!g_queue_is_empty(sd->interactive)) {
+		imcb_error(ic, "%d commands written while disconnected were not "
+		           "delivered", g_queue_get_length(sd->interactive));
+	}
 
 	while (ic->groupchats) {
 		imcb_chat_free(ic->groupchats->data);
@@ -1373,10 +3072,28 @@ static void skype_logout(struct im_connection *ic)
 		skype_group_free(sg, FALSE);
 	}
 
-	if (sd->ssl) {
-		ssl_disconnect(sd->ssl);
+	skype_disconnect(ic);
+	if (sd->reconnect_id) {
+		b_event_remove(sd->reconnect_id);
+	}
+
+	if (sd->filetransfer_poll) {
+		b_event_remove(sd->filetransfer_poll);
+	}
+	while (sd->relays) {
+		struct skype_relay *relay = sd->relays->data;
+		sd->relays = g_list_remove(sd->relays, relay);
+		imcb_file_canceled(ic, relay->ft, "Logged out");
 	}
 
+	g_hash_table_destroy(sd->calls);
+	g_hash_table_destroy(sd->filetransfers);
+	g_hash_table_destroy(sd->info_requests);
+	g_hash_table_destroy(sd->info_cache);
+	g_string_free(sd->rbuf, TRUE);
+	g_hash_table_destroy(sd->pending);
+	g_queue_free_full(sd->bulk, (GDestroyNotify) skype_request_free);
+	g_queue_free_full(sd->interactive, g_free);
 	g_free(sd->username);
 	g_free(sd->handle);
 	g_free(sd);
@@ -1424,6 +3141,7 @@ const struct skype_away_state *skype_away_state_by_name(char *name)
 static void skype_set_away(struct im_connection *ic, char *state_txt,
                            char *message)
 {
+	struct skype_data *sd = ic->proto_data;
 	const struct skype_away_state *state;
 
 	/* Unused parameter */
@@ -1434,6 +3152,7 @@ static void skype_set_away(struct im_connection *ic, char *state_txt,
 	} else {
 		state = skype_away_state_by_name(state_txt);
 	}
+	sd->status = state->code;
 	skype_printf(ic, "SET USERSTATUS %s\n", state->code);
 }
 
@@ -1494,16 +3213,26 @@ static void skype_call(struct im_connection *ic, char *value)
 	g_free(nick);
 }
 
-static void skype_hangup(struct im_connection *ic)
+/* Hang up the calls with the given partner, or every call we know about if
+ * no handle is given. */
+static void skype_hangup(struct im_connection *ic, char *handle)
 {
 	struct skype_data *sd = ic->proto_data;
+	GHashTableIter iter;
+	gpointer value;
+	int n = 0;
 
-	if (sd->call_id) {
-		skype_printf(ic, "SET CALL %s STATUS FINISHED\n",
-		             sd->call_id);
-		g_free(sd->call_id);
-		sd->call_id = 0;
-	} else {
+	g_hash_table_iter_init(&iter, sd->calls);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct skype_call *call = value;
+
+		if (handle && g_strcmp0(call->partner, handle)) {
+			continue;
+		}
+		skype_printf(ic, "SET CALL %s STATUS FINISHED\n", call->id);
+		n++;
+	}
+	if (!n) {
 		imcb_error(ic, "There are no active calls currently.");
 	}
 }
@@ -1516,7 +3245,7 @@ static char *skype_set_call(void *data, char *value)
 	if (value) {
 		skype_call(ic, value);
 	} else {
-		skype_hangup(ic);
+		skype_hangup(ic, NULL);
 	}
 	return value;
 }
@@ -1552,6 +3281,7 @@ static void skype_add_buddy(struct im_connection *ic, char *who, char *group)
 
 static void skype_remove_buddy(struct im_connection *ic, char *who, char *group)
 {
+	struct skype_data *sd = ic->proto_data;
 	char *nick, *ptr;
 
 	/* Unused parameter */
@@ -1563,6 +3293,10 @@ static void skype_remove_buddy(struct im_connection *ic, char *who, char *group)
 		*ptr = '\0';
 	}
 	skype_printf(ic, "SET USER %s BUDDYSTATUS 1\n", nick);
+	/* Also abandons a running info command. */
+	skype_cancel(ic, "USER", nick);
+	skype_cancel(ic, "INFO", nick);
+	g_hash_table_remove(sd->info_requests, nick);
 	g_free(nick);
 }
 
@@ -1581,6 +3315,7 @@ void skype_chat_leave(struct groupchat *gc)
 	struct im_connection *ic = gc->ic;
 
 	skype_printf(ic, "ALTER CHAT %s LEAVE\n", gc->title);
+	skype_cancel(ic, "CHAT", gc->title);
 	gc->data = (void *) TRUE;
 }
 
@@ -1626,37 +3361,69 @@ struct groupchat *skype_chat_with(struct im_connection *ic, char *who)
 	return imcb_chat_new(ic, "");
 }
 
+/* Info queries get a tag of their own, so that cancelling them leaves the
+ * roster's queries about the same user alone. */
+static void skype_info_ask(struct im_connection *ic, char *nick,
+                           const char *property)
+{
+	char *line = g_strdup_printf("GET USER %s %s\n", nick, property);
+	char *tag = g_strdup_printf("INFO %s", nick);
+
+	skype_write_tagged(ic, line, strlen(line), tag);
+	g_free(line);
+	g_free(tag);
+}
+
 static void skype_get_info(struct im_connection *ic, char *who)
 {
 	struct skype_data *sd = ic->proto_data;
 	char *ptr, *nick;
 
+	struct skype_info_request *info;
+	struct skype_info_cached *cached;
+	int i;
+
 	nick = g_strdup(who);
 	ptr = strchr(nick, '@');
 	if (ptr) {
 		*ptr = '\0';
 	}
-	sd->is_info = TRUE;
-	skype_printf(ic, "GET USER %s FULLNAME\n", nick);
-	skype_printf(ic, "GET USER %s PHONE_HOME\n", nick);
-	skype_printf(ic, "GET USER %s PHONE_OFFICE\n", nick);
-	skype_printf(ic, "GET USER %s PHONE_MOBILE\n", nick);
-	skype_printf(ic, "GET USER %s NROF_AUTHED_BUDDIES\n", nick);
-	skype_printf(ic, "GET USER %s TIMEZONE\n", nick);
-	skype_printf(ic, "GET USER %s LASTONLINETIMESTAMP\n", nick);
-	skype_printf(ic, "GET USER %s SEX\n", nick);
-	skype_printf(ic, "GET USER %s LANGUAGE\n", nick);
-	skype_printf(ic, "GET USER %s COUNTRY\n", nick);
-	skype_printf(ic, "GET USER %s PROVINCE\n", nick);
-	skype_printf(ic, "GET USER %s CITY\n", nick);
-	skype_printf(ic, "GET USER %s HOMEPAGE\n", nick);
-	skype_printf(ic, "GET USER %s ABOUT\n", nick);
+
+	cached = g_hash_table_lookup(sd->info_cache, nick);
+	if (cached && cached->time + SKYPE_INFO_TTL >= time(NULL)) {
+		imcb_log(ic, "%s", cached->text);
+		g_free(nick);
+		return;
+	}
+	info = g_hash_table_lookup(sd->info_requests, nick);
+	if (info && info->time + SKYPE_INFO_TIMEOUT >= time(NULL)) {
+		/* Already asked, the reply will show up soon. */
+		g_free(nick);
+		return;
+	}
+	if (info) {
+		/* The last reply never came (an error, say), ask again. */
+		skype_cancel(ic, "INFO", nick);
+		g_hash_table_remove(sd->info_requests, nick);
+	}
+	info = g_new0(struct skype_info_request, 1);
+	info->handle = g_strdup(nick);
+	info->time = time(NULL);
+	info->values = g_new0(char *, ARRAY_SIZE(skype_info_fields));
+	g_hash_table_insert(sd->info_requests, info->handle, info);
+
+	for (i = 0; i < ARRAY_SIZE(skype_info_fields); i++) {
+		if (strcmp(skype_info_fields[i].property, SKYPE_INFO_LAST)) {
+			skype_info_ask(ic, nick, skype_info_fields[i].property);
+		}
+	}
 	/*
 	 * Hack: we query the bithday property which is always a single line,
 	 * so we can send the collected properties to the user when we have
 	 * this one.
 	 */
-	skype_printf(ic, "GET USER %s BIRTHDAY\n", nick);
+	skype_info_ask(ic, nick, SKYPE_INFO_LAST);
+	g_free(nick);
 }
 
 static void skype_init(account_t *acc)
@@ -1692,6 +3459,30 @@ static void skype_init(account_t *acc)
 	            NULL, acc);
 
 	set_add(&acc->set, "read_groups", "false", set_eval_bool, acc);
+
+	set_add(&acc->set, "filetransfer_progress", "0", set_eval_int, acc);
+
+	set_add(&acc->set, "filetransfer_relay", "false", set_eval_bool, acc);
+
+	set_add(&acc->set, "reconnect", "true", set_eval_bool, acc);
+
+	set_add(&acc->set, "reconnect_attempts", "10", set_eval_int, acc);
+
+	set_add_with_flags(&acc->set, "compression", "false", set_eval_bool, acc, ACC_SET_OFFLINE_ONLY);
+
+	set_add_with_flags(&acc->set, "framing", "true", set_eval_bool, acc, ACC_SET_OFFLINE_ONLY);
+
+	set_add_with_flags(&acc->set, "heartbeat", "30", set_eval_int, acc, ACC_SET_OFFLINE_ONLY);
+
+	set_add(&acc->set, "heartbeat_misses", "3", set_eval_int, acc);
+
+	set_add(&acc->set, "bulk_burst", "20", set_eval_int, acc);
+
+	set_add(&acc->set, "bulk_rate", "50", set_eval_int, acc);
+
+	set_add(&acc->set, "bulk_adaptive", "true", set_eval_bool, acc);
+
+	set_add(&acc->set, "bulk_window", "4", set_eval_int, acc);
 }
 
 #if BITLBEE_VERSION_CODE > BITLBEE_VER(3, 0, 1)
@@ -1726,7 +3517,7 @@ void *skype_buddy_action(struct bee_user *bu, const char *action, char * const a
 	if (!g_strcmp0(action, "CALL")) {
 		skype_call(bu->ic, bu->handle);
 	} else if (!g_strcmp0(action, "HANGUP")) {
-		skype_hangup(bu->ic);
+		skype_hangup(bu->ic, bu->handle);
 	}
 
 	return NULL;
@@ -1739,6 +3530,50 @@ void skype_join(struct im_connection *ic, char **args) {
 	skype_printf(ic, "GET CHAT %s ACTIVEMEMBERS\n", args[1]);
 }
 
+void skype_stats(struct im_connection *ic, char **args)
+{
+	struct skype_data *sd = ic->proto_data;
+	char *tx = g_format_size(sd->tx_bytes);
+	char *tx_wire = g_format_size(sd->tx_wire);
+	char *rx = g_format_size(sd->rx_bytes);
+	char *rx_wire = g_format_size(sd->rx_wire);
+
+	/* Unused parameter */
+	args = args;
+
+	imcb_log(ic, "Sent %s (%s on the wire), received %s (%s on the wire).",
+	         tx, tx_wire, rx, rx_wire);
+	imcb_log(ic, "Protocol: %s.", sd->framing ? "v2 (framed)" : "lines");
+	imcb_log(ic, "Bulk commands: %u queued, %u waiting for a reply, "
+	         "%" G_GUINT64_FORMAT " duplicates dropped.",
+	         g_queue_get_length(sd->bulk), g_list_length(sd->inflight),
+	         sd->deduplicated);
+	imcb_log(ic, "Cancelled: %" G_GUINT64_FORMAT " commands of parted chats "
+	         "and removed buddies.", sd->cancelled);
+	if (sd->rate > 0) {
+		imcb_log(ic, "Bulk rate limit: %.1f/s.", sd->rate);
+	}
+	if (sd->bulk_latency > 0) {
+		imcb_log(ic, "Skype latency: replies take %.0f ms.",
+		         sd->bulk_latency);
+	}
+	if (sd->pong_seen) {
+		imcb_log(ic, "Link round trip time: %.0f ms average, %.0f ms max.",
+		         sd->rtt, sd->rtt_max);
+	} else if (sd->heartbeat_id) {
+		imcb_log(ic, "Link round trip time: no PONG from skyped yet.");
+	}
+	if (sd->compress && sd->zout.total_out && sd->zin.total_in) {
+		imcb_log(ic, "Compression ratio: %.1f:1 sent, %.1f:1 received.",
+		         (double) sd->zout.total_in / sd->zout.total_out,
+		         (double) sd->zin.total_out / sd->zin.total_in);
+	}
+	g_free(tx);
+	g_free(tx_wire);
+	g_free(rx);
+	g_free(rx_wire);
+}
+
 void init_plugin(void)
 {
 	struct prpl *ret = g_new0(struct prpl, 1);
@@ -1766,4 +3601,5 @@ void init_plugin(void)
 	register_protocol(ret);
 
 	plugin_command_add(ret, "join", 1, skype_join);
+	plugin_command_add(ret, "stats", 0, skype_stats);
 }
@@ -25,8 +25,15 @@ import os
 import signal
 import time
 import socket
+import errno
+import struct
+import stat
 import Skype4Py
 import hashlib
+import zlib
+import threading
+from collections import deque, OrderedDict
+from Queue import Queue, Empty
 from ConfigParser import ConfigParser, NoOptionError
 from traceback import print_exception
 from fcntl import fcntl, F_SETFD, FD_CLOEXEC
@@ -34,6 +41,54 @@ import ssl
 
 __version__ = "0.1.1"
 
+# Skype API commands sent but not answered yet, at most
+MAX_PENDING = 32
+# seconds after which we stop waiting for the reply of a command
+COMMAND_TIMEOUT = 30
+# ids of our commands start here; Skype4Py picks random ids for its own
+# (blocking) ones, so they may clash, see SkypeApi.submit()
+FIRST_COMMAND_ID = 1000
+# times a command is tried with the next id after such a clash
+ID_RETRIES = 3
+# bytes read from the plugin at once
+RECV_CHUNK = 65536
+# bytes written to the plugin at once
+SEND_CHUNK = 65536
+# seconds a client gets for the tls handshake and logging in
+AUTH_TIMEOUT = 30
+# events kept while no client is logged in, at most, and their size
+BACKLOG_COUNT = 1000
+BACKLOG_BYTES = 1024 * 1024
+# bytes spilled to the backlog file, at most
+BACKLOG_SPILL_BYTES = 16 * 1024 * 1024
+# bytes queued for a client, at most, well above what replaying the
+# backlog queues; one that doesn't read them is disconnected
+SEND_LIMIT = 2 * (BACKLOG_BYTES + BACKLOG_SPILL_BYTES)
+# user properties of which only the latest value matters, see
+# presence_key()
+PRESENCE_PROPERTIES = ("ONLINESTATUS", "MOOD_TEXT", "RICH_MOOD_TEXT", "BUDDYSTATUS", "LASTONLINETIMESTAMP")
+# milliseconds presence notifications are held back, only the latest
+# one of each user and property is forwarded
+PRESENCE_WINDOW = 300
+# object properties answered from the cache, see PropertyCache; Skype
+# tells about their changes
+CACHE_PROPERTIES = {
+	"USER": ("FULLNAME",),
+	"GROUP": ("DISPLAYNAME", "TYPE"),
+	"CHAT": ("TOPIC", "ADDER"),
+	"CHATMESSAGE": ("FROM_HANDLE", "FROM_DISPNAME", "BODY", "TYPE", "CHATNAME", "TIMESTAMP"),
+}
+# changes which make other cached properties stale, without telling
+CACHE_INVALIDATES = {
+	("CHATMESSAGE", "EDITED_TIMESTAMP"): ("BODY",),
+	("CHATMESSAGE", "EDITED_BY"): ("BODY",),
+}
+# cached properties, at most
+CACHE_SIZE = 10000
+# seconds a cached property is used; Skype tells about changes of our
+# contacts only, not of other users or chats we left
+CACHE_TTL = 600
+
 import gobject
 
 def eh(type, value, tb):
@@ -42,62 +97,390 @@ def eh(type, value, tb):
 	if type != KeyboardInterrupt:
 		print_exception(type, value, tb)
 	gobject.MainLoop().quit()
-	if options.conn:
-		options.conn.close()
+	for i in options.clients[:]:
+		i.close()
+	if options.socket and os.path.exists(options.socket):
+		os.unlink(options.socket)
+	options.logger.close()
 	skype.skype.Client.Shutdown()
 	sys.exit("Exiting.")
 
 sys.excepthook = eh
 
-def input_handler(fd, io_condition = None):
-	global options
-	global skype
-	if options.buf:
-		for i in options.buf:
-			skype.send(i.strip())
-		options.buf = None
-	else:
+def receive(conn):
+	"""Reads everything the plugin sent so far, not just what fits in one
+	call: tls may have more buffered than the socket shows. Returns the
+	data and if the connection was closed (or broke)."""
+	chunks = []
+	conn.setblocking(0)
+	try:
+		while True:
+			try:
+				data = conn.recv(RECV_CHUNK)
+			except ssl.SSLError, s:
+				if s.errno == ssl.SSL_ERROR_WANT_READ:
+					break
+				dprint("Warning, receiving failed (%s).", s)
+				return ''.join(chunks), True
+			except socket.error, s:
+				if s.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+					break
+				dprint("Warning, receiving failed (%s).", s)
+				return ''.join(chunks), True
+			if data == '':
+				return ''.join(chunks), True
+			chunks.append(data)
+	finally:
+		conn.setblocking(1)
+	return ''.join(chunks), False
+
+def presence_key(msg_text):
+	"""The user and property of a presence notification, which a later
+	one with the same key supersedes, or None."""
+	words = msg_text.split(" ", 3)
+	if len(words) >= 3 and words[0] == "USER" and words[2] in PRESENCE_PROPERTIES:
+		return " ".join(words[:3])
+	if len(words) >= 2 and words[0] == "USERSTATUS":
+		return words[0]
+	return None
+
+def deliver(clients, e, reqid=0):
+	"""Sends an encoded message to the clients, encoded once for all of
+	them, in the formats they need."""
+	frame = None
+	lines = None
+	for i in clients:
+		if i.framing:
+			# multiline messages travel in a single frame
+			if frame is None:
+				frame = struct.pack('>II', len(e), reqid) + e
+			i.send(frame)
+			continue
+		if lines is None:
+			if "\n" in e:
+				# crappy skype prefixes only the first line for
+				# multiline messages so we need to do so for the other
+				# lines, too. this is something like:
+				# 'CHATMESSAGE id BODY first line\nsecond line' ->
+				# 'CHATMESSAGE id BODY first line\nCHATMESSAGE id BODY second line'
+				prefix = " ".join(e.split(" ")[:3])
+				lines = "".join(["%s %s\n" % (prefix, j) for j in " ".join(e.split(" ")[3:]).split("\n")])
+			else:
+				lines = e + "\n"
+		i.send(lines)
+
+class Backlog:
+	"""Events which arrived while no client was logged in, replayed to
+	the next one. Bounded: the oldest ones are spilled to the backlog
+	file if there is one, dropped otherwise. Only the latest presence of
+	a user is kept, the earlier ones would be overwritten anyway."""
+	def __init__(self, path=None):
+		# key -> encoded event; presence events are keyed by user and
+		# property, the rest by a counter
+		self.events = OrderedDict()
+		self.size = 0
+		self.serial = 0
+		self.path = path
+		self.spill = None
+		self.spilled = 0
+		self.dropped = 0
+		if path and os.path.exists(path):
+			# left over by a previous run, still not seen by anybody
+			self.spilled = os.path.getsize(path)
+
+	def key(self, e):
+		key = presence_key(e)
+		if key:
+			return key
+		self.serial += 1
+		return self.serial
+
+	def add(self, e):
+		key = self.key(e)
+		old = self.events.pop(key, None)
+		if old is not None:
+			self.size -= len(old)
+		self.events[key] = e
+		self.size += len(e)
+		while len(self.events) > BACKLOG_COUNT or self.size > BACKLOG_BYTES:
+			key, old = self.events.popitem(last=False)
+			self.size -= len(old)
+			self.evict(old)
+
+	def evict(self, e):
+		if not self.path or self.spilled + len(e) + 4 > BACKLOG_SPILL_BYTES:
+			self.dropped += 1
+			return
 		try:
-			input = fd.recv(1024)
-			if input == '':
-				raise Exception('Connection closed')
-		except Exception, s:
-			dprint("Warning, receiving 1024 bytes failed (%s)." % s)
-			fd.close()
+			if not self.spill:
+				self.spill = open(self.path, 'ab')
+			# length prefixed, as events may span several lines
+			self.spill.write(struct.pack('>I', len(e)) + e)
+			self.spill.flush()
+			self.spilled += len(e) + 4
+		except IOError, s:
+			dprint("Warning, spilling the backlog failed (%s).", s)
+			self.dropped += 1
+
+	def load(self):
+		"""Reads back and forgets the spilled events, oldest first."""
+		if self.spill:
+			self.spill.close()
+			self.spill = None
+		events = []
+		if not self.path or not self.spilled:
+			return events
+		try:
+			with open(self.path, 'rb') as f:
+				data = f.read()
+			os.unlink(self.path)
+		except (IOError, OSError), s:
+			dprint("Warning, reading the backlog failed (%s).", s)
+			return events
+		self.spilled = 0
+		pos = 0
+		while pos + 4 <= len(data):
+			n = struct.unpack('>I', data[pos:pos + 4])[0]
+			if pos + 4 + n > len(data):
+				# cut short by a crash
+				break
+			events.append(data[pos + 4:pos + 4 + n])
+			pos += 4 + n
+		return events
+
+	def replay(self, client):
+		events = self.load() + self.events.values()
+		self.events.clear()
+		self.size = 0
+		if self.dropped:
+			dprint("Warning, %d events were dropped from the backlog.", self.dropped)
+			self.dropped = 0
+		if not events:
+			return
+		dprint("Replaying %d events.", len(events))
+		for e in events:
+			dprint('<< %s', e)
+			deliver([client], e)
+
+class Client:
+	"""A logged in connection, see authenticate(). Each one has its own
+	buffers, compression and framing, and only gets the events it
+	subscribed to."""
+	def __init__(self, conn, buf):
+		global options
+		self.conn = conn
+		# deflate streams, see start_compression()
+		self.zin = None
+		self.zout = None
+		self.framing = False
+		# received data which is not yet a whole line or frame, starting
+		# with the leftovers of the login
+		self.rbuf = buf
+		# data queued for the client, and what is staged for the socket,
+		# see send()
+		self.wbuf = []
+		self.wbuf_bytes = 0
+		self.wout = ''
+		self.wwatch = 0
+		self.rwatch = 0
+		self.stats = {'plain_out': 0, 'wire_out': 0}
+		# object types of the events it wants, like "USER", None for all
+		self.subscriptions = None
+		options.clients.append(self)
+		conn.send("PASSWORD OK\n")
+		# even without leftovers: tls may hold more than the socket
+		# shows, and the watch would never fire for it
+		if self.input_handler(conn):
+			self.rwatch = gobject.io_add_watch(conn, gobject.IO_IN, self.input_handler)
+		if self in options.clients and len(options.clients) == 1:
+			# after its leftovers, so the events already use the
+			# compression and framing it asked for
+			options.backlog.replay(self)
+
+	def close(self):
+		global options
+		if self not in options.clients:
+			return
+		options.clients.remove(self)
+		if self.rwatch:
+			gobject.source_remove(self.rwatch)
+		if self.wwatch:
+			gobject.source_remove(self.wwatch)
+		self.conn.close()
+		dprint("Connection closed, compression ratio %s.", self.compression_ratio())
+
+	def input_handler(self, fd, io_condition = None):
+		data, closed = receive(fd)
+		if self.zin:
+			# the leftovers are never compressed: the plugin waits
+			# for our answer before it starts
+			data = self.zin.decompress(data)
+		self.rbuf += data
+		self.process_input()
+		if closed:
+			self.rwatch = 0
+			self.close()
 			return False
-		for i in input.split("\n"):
-			skype.send(i.strip())
-		return True
+		return self in options.clients
+
+	def process_input(self):
+		"""Hands every whole line or frame of the receive buffer to
+		Skype, keeping the rest for the next read."""
+		buf = self.rbuf
+		pos = 0
+		while not self.framing:
+			nl = buf.find("\n", pos)
+			if nl < 0:
+				break
+			i = buf[pos:nl].strip()
+			pos = nl + 1
+			if i == "COMPRESS DEFLATE" and not self.zin:
+				self.start_compression()
+				# the rest is already compressed
+				buf = self.zin.decompress(buf[pos:])
+				pos = 0
+				continue
+			if i == "FRAMING V2":
+				self.start_framing()
+				continue
+			self.command(i)
+		while self.framing and len(buf) - pos >= 8:
+			length, reqid = struct.unpack_from('>II', buf, pos)
+			if len(buf) - pos - 8 < length:
+				break
+			self.command(buf[pos + 8:pos + 8 + length], reqid)
+			pos += 8 + length
+		self.rbuf = buf[pos:]
+
+	def command(self, msg_text, reqid=0):
+		global skype
+		if msg_text.startswith("SUBSCRIBE"):
+			# "SUBSCRIBE USER CALL", or "SUBSCRIBE *" for everything
+			types = msg_text.split()[1:]
+			if not types or "*" in types:
+				self.subscriptions = None
+			else:
+				self.subscriptions = set(types)
+			self.send_msg("SUBSCRIBE %s" % " ".join(sorted(self.subscriptions or ["*"])), reqid)
+			return
+		if msg_text == "PING":
+			# the plugin times the link, not Skype, see
+			# skype_heartbeat() there
+			self.send_msg("PONG", reqid)
+			return
+		skype.send(msg_text, reqid, self)
+
+	def wants(self, msg_text):
+		return self.subscriptions is None or msg_text.split(" ", 1)[0] in self.subscriptions
+
+	def start_compression(self):
+		# the plugin holds back everything else until we answer, so
+		# this is where both streams switch to deflate; anything
+		# queued after the answer has to be compressed
+		self.send("COMPRESS OK\n")
+		self.stage()
+		self.zout = zlib.compressobj()
+		self.zin = zlib.decompressobj()
+		dprint("Compression enabled.")
+
+	def start_framing(self):
+		# this is still a line, only what comes after it is framed
+		self.send("FRAMING OK\n")
+		self.framing = True
+		dprint("Protocol v2 enabled.")
+
+	def send_msg(self, txt, reqid=0):
+		"""Sends a single message, as a line or as a frame whose header
+		carries the payload length and the id of the request it answers
+		(0 for events)."""
+		if self.framing:
+			self.send(struct.pack('>II', len(txt), reqid) + txt)
+		else:
+			self.send(txt + "\n")
+
+	def compression_ratio(self):
+		if not self.zout or not self.stats['wire_out']:
+			return "off"
+		return "%.1f:1" % (float(self.stats['plain_out']) / self.stats['wire_out'])
+
+	def send(self, txt):
+		"""Queues data for the client. It's written by flush() once the
+		socket is writable, together with whatever else was queued
+		meanwhile."""
+		if self not in options.clients:
+			return
+		self.wbuf.append(txt)
+		self.wbuf_bytes += len(txt)
+		if self.wbuf_bytes + len(self.wout) > SEND_LIMIT:
+			dprint("Warning, client does not read, %d bytes queued.", self.wbuf_bytes + len(self.wout))
+			self.close()
+			return
+		if not self.wwatch:
+			self.wwatch = gobject.io_add_watch(self.conn, gobject.IO_OUT, self.flush)
+
+	def stage(self):
+		"""Moves the queued data to the outgoing buffer, compressing it
+		if needed."""
+		txt = ''.join(self.wbuf)
+		del self.wbuf[:]
+		self.wbuf_bytes = 0
+		if self.zout and txt:
+			self.stats['plain_out'] += len(txt)
+			# one dictionary for the whole session, but flush every batch
+			txt = self.zout.compress(txt) + self.zout.flush(zlib.Z_SYNC_FLUSH)
+			self.stats['wire_out'] += len(txt)
+		self.wout += txt
+
+	def flush(self, sock, io_condition=None):
+		self.stage()
+		sock.setblocking(0)
+		try:
+			while self.wout:
+				# a tls write that would block has to be retried
+				# with the same data, so always start from the
+				# same place
+				n = sock.send(self.wout[:SEND_CHUNK])
+				if not n:
+					# tls would block
+					break
+				self.wout = self.wout[n:]
+		except ssl.SSLError, s:
+			if s.errno not in (ssl.SSL_ERROR_WANT_WRITE, ssl.SSL_ERROR_WANT_READ):
+				return self.send_failed(s)
+		except socket.error, s:
+			if s.errno not in (errno.EAGAIN, errno.EWOULDBLOCK):
+				return self.send_failed(s)
+		finally:
+			sock.setblocking(1)
+		if self.wout or self.wbuf:
+			return True
+		self.wwatch = 0
+		return False
+
+	def send_failed(self, s):
+		dprint("Warning, sending failed (%s).", s)
+		self.wwatch = 0
+		self.close()
+		return False
 
 def skype_idle_handler(skype):
+	skype.expire()
 	try:
 		c = skype.skype.Command("PING", Block=True)
 		skype.skype.SendCommand(c)
 	except (Skype4Py.SkypeAPIError, AttributeError), s:
-		dprint("Warning, pinging Skype failed (%s)." % (s))
+		dprint("Warning, pinging Skype failed (%s).", s)
 		time.sleep(1)
 	return True
 
-def send(sock, txt, tries=10):
-	global options
-	if not options.conn: return
-	try:
-		done = sock.sendall(txt)
-	except socket.error as s:
-		dprint("Warning, sending '%s' failed (%s)." % (txt, s))
-		options.conn.close()
-		options.conn = False
-
 def bitlbee_idle_handler(skype):
 	global options
-	done = False
-	if options.conn:
-		try:
-			e = "PING"
-			done = send(options.conn, "%s\n" % e)
-		except Exception, s:
-			dprint("Warning, sending '%s' failed (%s)." % (e, s))
-			options.conn.close()
+	for i in options.clients[:]:
+		i.send_msg("PING")
+	skype.cache.report()
+	if skype.coalesced:
+		dprint("%d presence notifications coalesced.", skype.coalesced)
+		skype.coalesced = 0
 	return True
 
 def server(host, port, skype = None):
@@ -113,77 +496,247 @@ def server(host, port, skype = None):
 
 	gobject.io_add_watch(sock, gobject.IO_IN, listener)
 
+def unix_server(path):
+	# no TLS here: only we can connect, see unix_listener()
+	if os.path.exists(path) and stat.S_ISSOCK(os.stat(path).st_mode):
+		os.unlink(path)
+	sock = socket.socket(socket.AF_UNIX)
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	old = os.umask(0177)
+	try:
+		sock.bind(path)
+	finally:
+		os.umask(old)
+	sock.listen(1)
+
+	gobject.io_add_watch(sock, gobject.IO_IN, unix_listener)
+
+def unix_listener(sock, skype):
+	global options
+	rawsock, addr = sock.accept()
+	creds = rawsock.getsockopt(socket.SOL_SOCKET, socket.SO_PEERCRED, struct.calcsize('3i'))
+	pid, uid, gid = struct.unpack('3i', creds)
+	if uid != os.getuid():
+		dprint("Warning, rejecting connection from uid %d.", uid)
+		rawsock.close()
+		return True
+	Handshake(rawsock, False)
+	return True
+
+def ssl_context():
+	# one context for all connections: its session cache and ticket keys
+	# let a reconnecting plugin resume with an abbreviated handshake
+	if not hasattr(ssl, 'SSLContext'):
+		dprint("Warning, no ssl.SSLContext (Python < 2.7.9), TLS sessions can't be resumed.")
+		return None
+	ctx = ssl.SSLContext(ssl.PROTOCOL_SSLv23)
+	ctx.options |= ssl.OP_NO_SSLv2 | ssl.OP_NO_SSLv3
+	try:
+		ctx.load_cert_chain(options.config.sslcert, options.config.sslkey)
+	except (IOError, ssl.SSLError), s:
+		dprint("Warning, loading the certificate failed (%s), did you create it?", s)
+		return None
+	return ctx
+
 def listener(sock, skype):
 	global options
 	rawsock, addr = sock.accept()
+	rawsock.setblocking(0)
 	try:
-		options.conn = ssl.wrap_socket(rawsock,
-			server_side=True,
-			certfile=options.config.sslcert,
-			keyfile=options.config.sslkey,
-			ssl_version=ssl.PROTOCOL_TLSv1)
+		if options.sslctx:
+			conn = options.sslctx.wrap_socket(rawsock,
+				server_side=True,
+				do_handshake_on_connect=False)
+		else:
+			conn = ssl.wrap_socket(rawsock,
+				server_side=True,
+				certfile=options.config.sslcert,
+				keyfile=options.config.sslkey,
+				ssl_version=ssl.PROTOCOL_SSLv23,
+				do_handshake_on_connect=False)
 	except (ssl.SSLError, socket.error) as err:
+		rawsock.close()
 		if isinstance(err, ssl.SSLError):
 			dprint("Warning, SSL init failed, did you create your certificate?")
 			return False
 		else:
 			dprint('Warning, SSL init failed')
 			return True
-	if hasattr(options.conn, 'handshake'):
+	Handshake(conn, True)
+	return True
+
+class Handshake:
+	"""A client which is still connecting: does the tls handshake and reads
+	the login without ever waiting for the client, so the main loop keeps
+	forwarding events meanwhile."""
+	def __init__(self, sock, tls):
+		self.sock = sock
+		self.tls = tls
+		self.buf = ''
+		self.watch = 0
+		self.timer = gobject.timeout_add(AUTH_TIMEOUT * 1000, self.expire)
+		self.step()
+
+	def wait(self, io_condition):
+		self.watch = gobject.io_add_watch(self.sock, io_condition, self.ready)
+
+	def ready(self, sock, io_condition):
+		self.watch = 0
+		self.step()
+		return False
+
+	def step(self):
+		if self.tls:
+			try:
+				self.sock.do_handshake()
+			except ssl.SSLError, s:
+				if s.errno == ssl.SSL_ERROR_WANT_READ:
+					return self.wait(gobject.IO_IN)
+				if s.errno == ssl.SSL_ERROR_WANT_WRITE:
+					return self.wait(gobject.IO_OUT)
+				return self.fail("handshake failed (%s)" % s)
+			except socket.error, s:
+				return self.fail("handshake failed (%s)" % s)
+			self.tls = False
 		try:
-			options.conn.handshake()
-		except Exception:
-			dprint("Warning, handshake failed, closing connection.")
-			return False
-	ret = 0
-	try:
-		line = options.conn.recv(1024)
-		if line.startswith("USERNAME") and line.split(' ')[1].strip() == options.config.username:
-			ret += 1
-		line = options.conn.recv(1024)
-		if line.startswith("PASSWORD") and hashlib.sha1(line.split(' ')[1].strip()).hexdigest() == options.config.password:
-			ret += 1
-	except Exception, s:
-		dprint("Warning, receiving 1024 bytes failed (%s)." % s)
-		options.conn.close()
+			data, closed = receive(self.sock)
+		except Exception, s:
+			return self.fail("receiving failed (%s)" % s)
+		self.buf += data
+		# the plugin doesn't wait for our answer, so both lines (and
+		# even more) may arrive in a single read
+		if self.buf.count("\n") >= 2:
+			gobject.source_remove(self.timer)
+			authenticate(self.sock, self.buf)
+		elif closed:
+			self.fail("connection closed during login")
+		else:
+			self.wait(gobject.IO_IN)
+
+	def expire(self):
+		self.timer = 0
+		self.fail("login timed out")
 		return False
+
+	def fail(self, why):
+		dprint("Warning, %s, closing connection.", why)
+		if self.watch:
+			gobject.source_remove(self.watch)
+		if self.timer:
+			gobject.source_remove(self.timer)
+		self.sock.close()
+
+def credential(line, key):
+	"""The value of a login line like "USERNAME foo", None if the line is
+	something else or has no value."""
+	words = line.split(' ', 1)
+	if len(words) < 2 or words[0] != key:
+		return None
+	return words[1].strip()
+
+def authenticate(conn, buf):
+	global options
+	ret = 0
+	line, buf = buf.split("\n", 1)
+	if credential(line, "USERNAME") == options.config.username:
+		ret += 1
+	line, buf = buf.split("\n", 1)
+	password = credential(line, "PASSWORD")
+	if password is not None and hashlib.sha1(password).hexdigest() == options.config.password:
+		ret += 1
+	conn.setblocking(1)
 	if ret == 2:
 		dprint("Username and password OK.")
-		options.conn.send("PASSWORD OK\n")
-		gobject.io_add_watch(options.conn, gobject.IO_IN, input_handler)
-		return True
+		Client(conn, buf)
 	else:
 		dprint("Username and/or password WRONG.")
-		options.conn.send("PASSWORD KO\n")
-		return False
+		try:
+			conn.send("PASSWORD KO\n")
+		except Exception:
+			pass
+		conn.close()
 
-def dprint(msg):
-	from time import strftime
-	global options
+class Log:
+	"""Writes the debug messages from a thread of its own, so the main
+	loop only queues them. The messages are formatted there as well."""
+	def __init__(self, path=None):
+		self.queue = Queue()
+		self.file = open(path, "a") if path else None
+		self.thread = None
+		# the timestamp of the last second, formatted
+		self.second = None
+		self.stamp = ""
 
-	if options.debug:
-		import inspect
-		prefix = strftime("[%Y-%m-%d %H:%M:%S]") + " %s:%d" % inspect.stack()[1][1:3]
-		sanitized = msg
+	def write(self, msg, args, where):
+		if not self.thread:
+			self.thread = threading.Thread(target=self.run, name="log")
+			self.thread.daemon = True
+			self.thread.start()
+		self.queue.put((time.time(), msg, args, where))
 
+	def format(self, now, msg, args, where):
+		if int(now) != self.second:
+			self.second = int(now)
+			self.stamp = time.strftime("[%Y-%m-%d %H:%M:%S]", time.localtime(now))
 		try:
-			print prefix + ": " + msg
+			if args:
+				msg = msg % args
+			if isinstance(msg, unicode):
+				# like the plugin gets it
+				msg = msg.encode("UTF-8")
 		except Exception, s:
-			try:
-				sanitized = msg.encode("ascii", "backslashreplace")
-			except Error, s:
+			msg = "[unable to format debug message: %s]" % s
+		if where:
+			return "%s %s:%d: %s\n" % (self.stamp, where[0], where[1], msg)
+		return "%s: %s\n" % (self.stamp, msg)
+
+	def run(self):
+		while True:
+			batch = [self.queue.get()]
+			# whatever else is there, with a single flush
+			while True:
 				try:
-					sanitized = "hex [" + msg.encode("hex") + "]"
-				except Error, s:
-					sanitized = "[unable to print debug message]"
-			print prefix + "~=" + sanitized
+					batch.append(self.queue.get_nowait())
+				except Empty:
+					break
+			lines = []
+			for i in batch:
+				if i is None:
+					self.output(lines)
+					return
+				lines.append(self.format(*i))
+			self.output(lines)
+
+	def output(self, lines):
+		data = "".join(lines)
+		try:
+			sys.stdout.write(data)
+			sys.stdout.flush()
+		except IOError:
+			pass
+		if self.file:
+			self.file.write(data)
+			self.file.flush()
+
+	def close(self):
+		"""Writes what is queued still."""
+		if self.thread:
+			self.queue.put(None)
+			self.thread.join(5)
+			self.thread = None
 
-		if options.log:
-			sock = open(options.log, "a")
-			sock.write("%s: %s\n" % (prefix, sanitized))
-			sock.close()
+def dprint(msg, *args):
+	"""Logs a debug message, formatted with the args (in the thread of
+	the log) only when debugging is enabled."""
+	global options
 
-		sys.stdout.flush()
+	if not options.debug:
+		return
+	where = None
+	if options.debug > 1:
+		import inspect
+		where = inspect.stack()[1][1:3]
+	options.logger.write(msg, args, where)
 
 class MockedSkype:
 	"""Mock class for Skype4Py.Skype(), in case the -m option is used."""
@@ -217,8 +770,95 @@ class MockedSkype:
 			self.lines = self.lines[1:]
 		return ret
 
+class PropertyCache:
+	"""Slowly changing object properties, to answer the GETs of the
+	plugin without asking Skype. Filled by the replies and kept up to date
+	by the notifications, both seen by SkypeApi.forward(), so only the
+	main loop touches it. Entries expire after CACHE_TTL seconds, for what
+	Skype doesn't notify about."""
+	def __init__(self):
+		# "OBJECT id PROPERTY" -> (the reply, like Skype sends it, when
+		# it was stored)
+		self.props = OrderedDict()
+		self.hits = 0
+		self.misses = 0
+		self.reported = (0, 0)
+
+	def key(self, msg_text):
+		"""The key of a reply or notification, or of the property a GET
+		asks for, if cached at all."""
+		words = msg_text.split(" ", 3)
+		if len(words) < 3 or words[2] not in CACHE_PROPERTIES.get(words[0], ()):
+			return None
+		return " ".join(words[:3])
+
+	def get(self, e):
+		if not e.startswith(u"GET "):
+			return None
+		key = self.key(e[4:])
+		if not key or key != e[4:]:
+			return None
+		entry = self.props.get(key)
+		if entry and time.time() - entry[1] > CACHE_TTL:
+			del self.props[key]
+			entry = None
+		if entry is None:
+			self.misses += 1
+			return None
+		self.hits += 1
+		return entry[0]
+
+	def update(self, msg_text):
+		if msg_text.startswith(u"DELETED "):
+			# like "DELETED GROUP 42"
+			prefix = msg_text[8:] + u" "
+			for key in [i for i in self.props if i.startswith(prefix)]:
+				del self.props[key]
+			return
+		words = msg_text.split(" ", 3)
+		if len(words) < 3:
+			return
+		for i in CACHE_INVALIDATES.get((words[0], words[2]), ()):
+			self.props.pop(u" ".join((words[0], words[1], i)), None)
+		key = self.key(msg_text)
+		if not key:
+			return
+		self.props.pop(key, None)
+		self.props[key] = (msg_text, time.time())
+		if len(self.props) > CACHE_SIZE:
+			self.props.popitem(last=False)
+
+	def report(self):
+		if (self.hits, self.misses) == self.reported:
+			return
+		self.reported = (self.hits, self.misses)
+		dprint("Property cache: %d hits, %d misses, %d entries.", self.hits, self.misses, len(self.props))
+
 class SkypeApi:
 	def __init__(self, mock, username, password):
+		# all of this first, Skype4Py may call us right away
+		# commands sent to Skype, id -> (request id, time sent, client),
+		# and the ones waiting for room, (command, request id, client)
+		self.pending = {}
+		self.waiting = deque()
+		self.next_id = FIRST_COMMAND_ID
+		# replies arrive on the thread of Skype4Py
+		self.lock = threading.Lock()
+		# messages for the clients, (text, request id, is a reply,
+		# client asking, is from the cache), from any thread; the main loop sends them,
+		# woken up by the pipe
+		self.events = deque()
+		self.events_lock = threading.Lock()
+		self.woken = False
+		self.cache = PropertyCache()
+		# presence notifications held back, see hold()
+		self.held = OrderedDict()
+		self.held_timer = 0
+		self.coalesced = 0
+		self.wakeup = os.pipe()
+		for fd in self.wakeup:
+			fcntl(fd, F_SETFD, FD_CLOEXEC)
+		gobject.io_add_watch(self.wakeup[0], gobject.IO_IN, self.drain)
 		if not mock:
 			self.skype = Skype4Py.Skype()
 			self.skype.OnNotify = self.recv
@@ -239,45 +879,97 @@ class SkypeApi:
 				os.write(w, '%s\n%s\n' % (username, password))
 				os.close(w)
 			self.skype = Skype4Py.Skype()
+			self.skype.OnReply = self.reply
 		else:
 			self.skype = MockedSkype(mock)
 
-	def recv(self, msg_text):
+	def recv(self, msg_text, reqid=0, reply=False, client=None, cached=False):
+		"""Queues a message for the clients, or for the one client a
+		reply is for. Called on the thread of Skype4Py for events, so it
+		must not touch the connections."""
+		with self.events_lock:
+			self.events.append((msg_text, reqid, reply, client, cached))
+			if self.woken:
+				return
+			self.woken = True
+		os.write(self.wakeup[1], 'x')
+
+	def drain(self, fd, io_condition=None):
+		"""Sends everything queued by recv(), in one batch."""
+		os.read(fd, 4096)
+		with self.events_lock:
+			events = list(self.events)
+			self.events.clear()
+			self.woken = False
+		for i in events:
+			self.forward(*i)
+		return True
+
+	def hold(self, msg_text):
+		"""Holds back a presence notification for a while, replacing the
+		held one of the same user and property. Skype often sends bursts
+		of them."""
+		key = presence_key(msg_text)
+		if not key:
+			return False
+		if self.held.pop(key, None) is not None:
+			self.coalesced += 1
+		self.held[key] = msg_text
+		if not self.held_timer:
+			self.held_timer = gobject.timeout_add(PRESENCE_WINDOW, self.release)
+		return True
+
+	def release(self):
+		held = self.held
+		self.held = OrderedDict()
+		self.held_timer = 0
+		for i in held.values():
+			self.forward(i, coalesce=False)
+		return False
+
+	def forward(self, msg_text, reqid=0, reply=False, client=None, cached=False, coalesce=True):
 		global options
-		if msg_text == "PONG":
+		if msg_text == "PONG" and not reply:
+			# our own pings, see skype_idle_handler(); the plugin
+			# only gets the answers to its own ones, to time them
+			return
+		if reply:
+			# at least as new as a held notification
+			key = presence_key(msg_text)
+			if key:
+				self.held.pop(key, None)
+		elif coalesce and self.hold(msg_text):
 			return
-		if "\n" in msg_text:
-			# crappy skype prefixes only the first line for
-			# multiline messages so we need to do so for the other
-			# lines, too. this is something like:
-			# 'CHATMESSAGE id BODY first line\nsecond line' ->
-			# 'CHATMESSAGE id BODY first line\nCHATMESSAGE id BODY second line'
-			prefix = " ".join(msg_text.split(" ")[:3])
-			msg_text = ["%s %s" % (prefix, i) for i in " ".join(msg_text.split(" ")[3:]).split("\n")]
+		if reply:
+			# nobody else asked, and it may be gone meanwhile
+			clients = [i for i in options.clients if i is client]
 		else:
-			msg_text = [msg_text]
-		for i in msg_text:
-			try:
-				# Internally, BitlBee always uses UTF-8 and encodes/decodes as
-				# necessary to communicate with the IRC client; thus send the
-				# UTF-8 it expects
-				e = i.encode('UTF-8')
-			except:
-				# Should never happen, but it's better to send difficult to
-				# read data than crash because some message couldn't be encoded
-				e = i.encode('ascii', 'backslashreplace')
-			if options.conn:
-				dprint('<< ' + e)
-				try:
-					send(options.conn, e + "\n")
-				except Exception, s:
-					dprint("Warning, sending '%s' failed (%s)." % (e, s))
-					if options.conn: options.conn.close()
-					options.conn = False
+			clients = [i for i in options.clients if i.wants(msg_text)]
+		if not cached:
+			# an answer from the cache would keep its entry fresh
+			# forever
+			self.cache.update(msg_text)
+		try:
+			# Internally, BitlBee always uses UTF-8 and encodes/decodes as
+			# necessary to communicate with the IRC client; thus send the
+			# UTF-8 it expects
+			e = msg_text.encode('UTF-8')
+		except:
+			# Should never happen, but it's better to send difficult to
+			# read data than crash because some message couldn't be encoded
+			e = msg_text.encode('ascii', 'backslashreplace')
+		if not clients:
+			if not reply and not options.clients:
+				# nobody logged in, the next one gets it
+				dprint('.. %s', e)
+				options.backlog.add(e)
 			else:
-				dprint('-- ' + e)
+				dprint('-- %s', e)
+			return
+		dprint('<< %s', e)
+		deliver(clients, e, reqid)
 
-	def send(self, msg_text):
+	def send(self, msg_text, reqid=0, client=None):
 		if not len(msg_text) or msg_text == "PONG":
 			if msg_text == "PONG":
 				options.last_bitlbee_pong = time.time()
@@ -291,19 +983,92 @@ class SkypeApi:
 			# Should never happen, but it's better to send difficult to read
 			# data to Skype than to crash
 			e = msg_text.decode('ascii', 'backslashreplace')
-		dprint('>> ' + e)
-		try:
-			c = self.skype.Command(e, Block=True)
-			self.skype.SendCommand(c)
-			if hasattr(c, "Reply"):
-				self.recv(c.Reply) # Skype4Py answer
-			else:
-				for i in c: # mock may return multiple iterable answers
-					self.recv(i)
-		except Skype4Py.SkypeError:
-			pass
-		except Skype4Py.SkypeAPIError, s:
-			dprint("Warning, sending '%s' failed (%s)." % (e, s))
+		dprint('>> %s', e)
+		if isinstance(self.skype, MockedSkype):
+			# mock may return multiple iterable answers
+			for i in self.skype.Command(e, Block=True):
+				self.recv(i, reqid, True, client)
+			return
+		# don't wait for the reply, so Skype gets the next command
+		# while it's still working on this one
+		with self.lock:
+			# the plugin pairs some replies by their order, like the
+			# properties of a chat message, so a cached one must not
+			# overtake those of its earlier commands; they are queued
+			# with the lock held, see reply()
+			cached = None if self.busy(client) else self.cache.get(e)
+			if cached is not None:
+				# queued like the replies of Skype, not to overtake
+				# earlier events
+				self.recv(cached, reqid, True, client, True)
+				return
+			if len(self.pending) >= MAX_PENDING:
+				self.waiting.append((e, reqid, client))
+				return
+			id = self.reserve(reqid, client)
+		self.submit(id, e)
+
+	def busy(self, client):
+		"""Whether a command of the client is still unanswered, with the
+		lock held."""
+		jobs = self.pending.values() + list(self.waiting)
+		return any(i[2] is client for i in jobs)
+
+	def reserve(self, reqid, client):
+		"""Picks the id of the next command, with the lock held."""
+		id = self.next_id
+		self.next_id = self.next_id + 1 if self.next_id < 2**31 - 1 else FIRST_COMMAND_ID
+		self.pending[id] = (reqid, time.time(), client)
+		return id
+
+	def submit(self, id, e):
+		for i in range(ID_RETRIES + 1):
+			try:
+				self.skype.SendCommand(self.skype.Command(e, Block=False, Id=id))
+				return
+			except Skype4Py.SkypeAPIError, s:
+				with self.lock:
+					reqid, sent, client = self.pending.pop(id)
+					if "conflict" in str(s).lower() and i < ID_RETRIES:
+						# one of Skype4Py's own commands has this id
+						id = self.reserve(reqid, client)
+						continue
+					# the plugin waits for the reply
+					self.recv(u"ERROR 0 %s" % s, reqid, True, client)
+				break
+		dprint("Warning, sending '%s' failed (%s).", e, s)
+
+	def pump(self):
+		"""Sends waiting commands while there is room."""
+		while True:
+			with self.lock:
+				if not self.waiting or len(self.pending) >= MAX_PENDING:
+					return
+				e, reqid, client = self.waiting.popleft()
+				id = self.reserve(reqid, client)
+			self.submit(id, e)
+
+	def reply(self, command):
+		with self.lock:
+			job = self.pending.pop(command.Id, None)
+			if job:
+				reqid, sent, client = job
+				# errors too, the plugin waits for the reply; queued
+				# before send() can see the command answered
+				self.recv(command.Reply, reqid, True, client)
+		self.pump()
+
+	def expire(self):
+		"""Fails the commands Skype never answered."""
+		now = time.time()
+		with self.lock:
+			for id, (reqid, sent, client) in self.pending.items():
+				if now - sent > COMMAND_TIMEOUT:
+					dprint("Warning, no reply to command %d.", id)
+					del self.pending[id]
+					# the plugin waits for the reply
+					self.recv(u"ERROR 0 no reply from Skype", reqid, True, client)
+		self.pump()
 
 def main(args=None):
 	global options
@@ -324,24 +1089,29 @@ def main(args=None):
 		help='set the tcp host, supports IPv4 and IPv6 (default: %(default)s)')
 	parser.add_argument('-p', '--port', type=int,
 		help='set the tcp port (default: %(default)s)')
+	parser.add_argument('-s', '--socket', metavar='path',
+		help='listen on a unix socket instead of tcp, without tls (default: none)')
 	parser.add_argument('-l', '--log', metavar='path',
 		help='set the log file in background mode (default: none)')
 	parser.add_argument('-v', '--version', action='store_true', help='display version information')
 	parser.add_argument('-u', '--skypeusername', help="Skype username")
 	parser.add_argument('-P', '--skypepassword', help="Skype password")
 	parser.add_argument('-m', '--mock', help='fake interactions with skype (only useful for tests)')
-	parser.add_argument('-d', '--debug', action='store_true', help='enable debug messages')
+	parser.add_argument('-d', '--debug', action='count', default=0,
+		help='enable debug messages, twice for the place of each one')
 	options = parser.parse_args(sys.argv[1:] if args is None else args)
 
 	if options.version:
 		print "skyped %s" % __version__
 		sys.exit(0)
 
-	# well, this is a bit hackish. we store the socket of the last connected client
-	# here and notify it. maybe later notify all connected clients?
-	options.conn = None
-	# this will be read first by the input handler
-	options.buf = None
+	# writes the debug messages, see dprint()
+	options.logger = Log(options.log)
+	# the logged in connections, see Client; all of them get the events
+	# they subscribed to
+	options.clients = []
+	# shared by all tls connections, see ssl_context()
+	options.sslctx = None
 
 	if not os.path.exists(options.config):
 		parser.error(( "Can't find configuration file at '%s'. "
@@ -366,9 +1136,25 @@ def main(args=None):
 		pass
 	if not options.port:
 		options.port = port
-	dprint("Parsing config file '%s' done, username is '%s'." % (cfgpath, options.config.username))
-	dprint('skyped is started on port %s' % options.port)
-	server(options.host, options.port)
+	try:
+		if not options.socket:
+			options.socket = os.path.expanduser(options.config.get('skyped', 'socket').split('#', 1)[0].strip())
+	except NoOptionError:
+		pass
+	try:
+		backlog = os.path.expanduser(options.config.get('skyped', 'backlog').split('#', 1)[0].strip())
+	except NoOptionError:
+		backlog = None
+	# events for the clients, while none is logged in
+	options.backlog = Backlog(backlog or None)
+	dprint("Parsing config file '%s' done, username is '%s'.", cfgpath, options.config.username)
+	if options.socket:
+		dprint('skyped is started on unix socket %s', options.socket)
+		unix_server(options.socket)
+	else:
+		dprint('skyped is started on port %s', options.port)
+		options.sslctx = ssl_context()
+		server(options.host, options.port)
 	try:
 		skype = SkypeApi(options.mock, options.skypeusername, options.skypepassword)
 	except Skype4Py.SkypeAPIError, s: